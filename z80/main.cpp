@@ -6,982 +6,2194 @@
 //  Copyright (c) 2015 Sijmen Mulder. All rights reserved.
 //
 
+#include "z80.h"
+
 #include <iostream>
 #include <iomanip>
-#include <sstream>
 #include <array>
+#include <vector>
+#include <memory>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <csignal>
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+// Deliberately plain second implementation of the documented Z80
+// instruction set, used by the fuzzer to cross-check Z80Core. It decodes
+// opcodes by their bit fields as laid out in the Zilog tables, rather than
+// through the Op enums, and shares no code with the core. It only covers
+// the part of the instruction set the core implements. Where the core's
+// encoding differs from the documented one, the fuzzer translates the
+// instruction first, see DIVERGENCES. Repeating block instructions run one
+// iteration per step, as on hardware.
+//
+// Like the core, it leaves R alone instead of counting instruction
+// fetches, and clears flag bits 3 and 5 wherever it sets flags, which the
+// Zilog tables leave unspecified.
+struct RefZ80 {
+	uint8_t a, f, b, c, d, e, h, l;
+	uint8_t a2, f2, b2, c2, d2, e2, h2, l2;
+	uint8_t i, r;
+	uint16_t ix, iy, sp, pc;
+	uint8_t mem[MEM_SIZE];
+	uint8_t ports[256];
+	
+	static int length(const uint8_t *code);
+	void step();
+	void exec(const uint8_t *code, uint16_t next);
+	
+private:
+	friend class AluCheck;
+	
+	const uint8_t *code_ = nullptr;
+	
+	uint8_t fetch() { return code_ ? (pc++, *code_++) : mem[pc++]; }
+	uint16_t fetch16() { uint16_t lo = fetch(); return lo | fetch() << 8; }
+	uint16_t disp(uint16_t base) { return base + (int8_t)fetch(); }
+	
+	uint16_t get16(int n) const;
+	void set16(int n, uint16_t val);
+	uint8_t& reg(int n);
+	bool cond(int n) const;
+	
+	void push(uint16_t val) { mem[--sp] = val >> 8; mem[--sp] = val & 0xFF; }
+	uint16_t pop() { uint16_t lo = mem[sp++]; return lo | mem[sp++] << 8; }
+	
+	uint8_t add8(uint8_t x, uint8_t y, int carry);
+	uint8_t sub8(uint8_t x, uint8_t y, int carry);
+	uint8_t logic8(uint8_t val, bool half);
+	uint8_t inc8(uint8_t val);
+	uint8_t dec8(uint8_t val);
+	void alu(int op, uint8_t val);
+	
+	void ldi(int dir);
+	void cpi();
+	void ini();
+	void outi();
+};
+
+int RefZ80::length(const uint8_t *code)
+{
+	uint8_t op = code[0];
+	uint8_t op2 = code[1];
+	
+	switch (op) {
+		case 0xDD:
+		case 0xFD:
+			switch (op2) {
+				case 0x34: case 0x35: return 3;
+				case 0x36: return 4;
+				case 0xE9: return 2;
+			}
+			if ((op2 & 0xC7) == 0x46 && op2 != 0x76) return 3;
+			if (op2 >= 0x70 && op2 <= 0x77 && op2 != 0x76) return 3;
+			if ((op2 & 0xC7) == 0x86) return 3;
+			return 0;
+		
+		case 0xED:
+			switch (op2) {
+				case 0x47: case 0x4F: case 0xA0: case 0xA1: case 0xA8:
+				case 0xB0: case 0xB1: case 0xB2: case 0xB3: case 0xB8:
+					return 2;
+			}
+			return 0;
+	}
+	
+	if (op >= 0x40 && op < 0xC0)
+		return op == 0x76 ? 0 : 1;
+	
+	if (op < 0x40) {
+		switch (op & 0x0F) {
+			case 0x01: return 3;
+			case 0x03: case 0x09: case 0x0B: return 1;
+		}
+		switch (op & 0x07) {
+			case 0x04: case 0x05: return 1;
+			case 0x06: return 2;
+		}
+		switch (op) {
+			case 0x00: case 0x02: case 0x08: case 0x0A: case 0x12: case 0x1A: return 1;
+			case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: return 2;
+			case 0x32: case 0x3A: return 3;
+		}
+		return 0;
+	}
+	
+	switch (op & 0x07) {
+		case 0x00: return 1;
+		case 0x02: case 0x04: return 3;
+		case 0x06: return 2;
+	}
+	switch (op) {
+		case 0xC1: case 0xD1: case 0xE1: case 0xF1: return 1;
+		case 0xC5: case 0xD5: case 0xE5: case 0xF5: return 1;
+		case 0xC9: case 0xD9: case 0xE9: case 0xEB: return 1;
+		case 0xC3: case 0xCD: return 3;
+	}
+	return 0;
+}
+
+uint8_t& RefZ80::reg(int n)
+{
+	switch (n) {
+		case 0: return b;
+		case 1: return c;
+		case 2: return d;
+		case 3: return e;
+		case 4: return h;
+		case 5: return l;
+		default: return a;
+	}
+}
+
+uint16_t RefZ80::get16(int n) const
+{
+	switch (n) {
+		case 0: return b << 8 | c;
+		case 1: return d << 8 | e;
+		case 2: return h << 8 | l;
+		default: return sp;
+	}
+}
+
+void RefZ80::set16(int n, uint16_t val)
+{
+	switch (n) {
+		case 0: b = val >> 8; c = val & 0xFF; break;
+		case 1: d = val >> 8; e = val & 0xFF; break;
+		case 2: h = val >> 8; l = val & 0xFF; break;
+		default: sp = val; break;
+	}
+}
+
+bool RefZ80::cond(int n) const
+{
+	static const uint8_t masks[] = { 0x40, 0x01, 0x04, 0x80 };
+	bool set = (f & masks[n >> 1]) != 0;
+	return n & 1 ? set : !set;
+}
+
+uint8_t RefZ80::add8(uint8_t x, uint8_t y, int carry)
+{
+	int res = x + y + carry;
+	int sres = (int8_t)x + (int8_t)y + carry;
+	uint8_t r8 = (uint8_t)res;
+	
+	f = (r8 & 0x80) | (r8 ? 0 : 0x40);
+	if ((x & 0x0F) + (y & 0x0F) + carry > 0x0F) f |= 0x10;
+	if (sres < -128 || sres > 127) f |= 0x04;
+	if (res > 0xFF) f |= 0x01;
+	
+	return r8;
+}
+
+uint8_t RefZ80::sub8(uint8_t x, uint8_t y, int carry)
+{
+	int res = x - y - carry;
+	int sres = (int8_t)x - (int8_t)y - carry;
+	uint8_t r8 = (uint8_t)res;
+	
+	f = (r8 & 0x80) | (r8 ? 0 : 0x40) | 0x02;
+	if ((x & 0x0F) - (y & 0x0F) - carry < 0) f |= 0x10;
+	if (sres < -128 || sres > 127) f |= 0x04;
+	if (res < 0) f |= 0x01;
+	
+	return r8;
+}
+
+uint8_t RefZ80::logic8(uint8_t val, bool half)
+{
+	int bits = 0;
+	for (int n = 0; n < 8; n++)
+		bits += val >> n & 1;
+	
+	f = (val & 0x80) | (val ? 0 : 0x40) | (half ? 0x10 : 0) | (bits % 2 ? 0 : 0x04);
+	return val;
+}
+
+uint8_t RefZ80::inc8(uint8_t val)
+{
+	uint8_t res = val + 1;
+	
+	f = (f & 0x01) | (res & 0x80) | (res ? 0 : 0x40);
+	if ((val & 0x0F) == 0x0F) f |= 0x10;
+	if (val == 0x7F) f |= 0x04;
+	
+	return res;
+}
+
+uint8_t RefZ80::dec8(uint8_t val)
+{
+	uint8_t res = val - 1;
+	
+	f = (f & 0x01) | (res & 0x80) | (res ? 0 : 0x40) | 0x02;
+	if ((val & 0x0F) == 0x00) f |= 0x10;
+	if (val == 0x80) f |= 0x04;
+	
+	return res;
+}
+
+void RefZ80::alu(int op, uint8_t val)
+{
+	switch (op) {
+		case 0: a = add8(a, val, 0); break;
+		case 1: a = add8(a, val, f & 0x01); break;
+		case 2: a = sub8(a, val, 0); break;
+		case 3: a = sub8(a, val, f & 0x01); break;
+		case 4: a = logic8(a & val, true); break;
+		case 5: a = logic8(a ^ val, false); break;
+		case 6: a = logic8(a | val, false); break;
+		case 7: sub8(a, val, 0); break;
+	}
+}
+
+void RefZ80::ldi(int dir)
+{
+	uint16_t hl = get16(2), de = get16(1), bc = get16(0);
+	
+	mem[de] = mem[hl];
+	set16(2, hl + dir);
+	set16(1, de + dir);
+	set16(0, --bc);
+	
+	f = (f & ~0x16) | (bc ? 0x04 : 0);
+}
+
+void RefZ80::cpi()
+{
+	uint16_t hl = get16(2), bc = get16(0);
+	uint8_t carry = f & 0x01;
+	
+	sub8(a, mem[hl], 0);
+	set16(2, hl + 1);
+	set16(0, --bc);
+	
+	f = (f & ~0x05) | carry | (bc ? 0x04 : 0);
+}
+
+void RefZ80::ini()
+{
+	uint16_t hl = get16(2);
+	
+	mem[hl] = ports[c];
+	set16(2, hl + 1);
+	b--;
+	
+	f = (f & 0x01) | 0x02 | (b ? 0 : 0x40);
+}
+
+void RefZ80::outi()
+{
+	uint16_t hl = get16(2);
+	
+	b--;
+	ports[c] = mem[hl];
+	set16(2, hl + 1);
+	
+	f = (f & 0x01) | 0x02 | (b ? 0 : 0x40);
+}
+
+// Executes the instruction in code instead of the one at PC, as if it had
+// been fetched from just before next. PC ends up at next unless it jumps.
+void RefZ80::exec(const uint8_t *code, uint16_t next)
+{
+	pc = next - length(code);
+	code_ = code;
+	step();
+	code_ = nullptr;
+}
+
+void RefZ80::step()
+{
+	uint8_t op = fetch();
+	uint16_t addr;
+	int8_t rel;
+	
+	if (op == 0xDD || op == 0xFD) {
+		uint16_t& xy = op == 0xDD ? ix : iy;
+		op = fetch();
+		
+		if ((op & 0xC7) == 0x86) { alu(op >> 3 & 7, mem[disp(xy)]); return; }
+		if ((op & 0xC7) == 0x46 && op != 0x76) { reg(op >> 3 & 7) = mem[disp(xy)]; return; }
+		if (op >= 0x70 && op <= 0x77 && op != 0x76) { addr = disp(xy); mem[addr] = reg(op & 7); return; }
+		
+		switch (op) {
+			case 0x34: addr = disp(xy); mem[addr] = inc8(mem[addr]); return;
+			case 0x35: addr = disp(xy); mem[addr] = dec8(mem[addr]); return;
+			case 0x36: addr = disp(xy); mem[addr] = fetch(); return;
+			case 0xE9: pc = xy; return;
+		}
+		return;
+	}
+	
+	if (op == 0xED) {
+		switch (fetch()) {
+			case 0x47: i = a; break;
+			case 0x4F: r = a; break;
+			case 0xA0: ldi(1); break;
+			case 0xA8: ldi(-1); break;
+			case 0xA1: cpi(); break;
+			case 0xB0: ldi(1); if (get16(0)) pc -= 2; break;
+			case 0xB8: ldi(-1); if (get16(0)) pc -= 2; break;
+			case 0xB1: cpi(); if (get16(0) && !(f & 0x40)) pc -= 2; break;
+			case 0xB2: ini(); if (b) pc -= 2; break;
+			case 0xB3: outi(); if (b) pc -= 2; break;
+		}
+		return;
+	}
+	
+	if (op >= 0x40 && op < 0x80) {
+		int dst = op >> 3 & 7, from = op & 7;
+		uint8_t val = from == 6 ? mem[get16(2)] : reg(from);
+		
+		if (dst == 6)
+			mem[get16(2)] = val;
+		else
+			reg(dst) = val;
+		return;
+	}
+	
+	if (op >= 0x80 && op < 0xC0) {
+		int from = op & 7;
+		alu(op >> 3 & 7, from == 6 ? mem[get16(2)] : reg(from));
+		return;
+	}
+	
+	if (op < 0x40) {
+		int rr = op >> 4 & 3;
+		int n = op >> 3 & 7;
+		
+		switch (op & 0x0F) {
+			case 0x01: set16(rr, fetch16()); return;
+			case 0x03: set16(rr, get16(rr) + 1); return;
+			case 0x0B: set16(rr, get16(rr) - 1); return;
+			case 0x09: {
+				uint32_t hl = get16(2), val = get16(rr), res = hl + val;
+				f &= ~0x13;
+				if ((hl & 0x0FFF) + (val & 0x0FFF) > 0x0FFF) f |= 0x10;
+				if (res > 0xFFFF) f |= 0x01;
+				set16(2, (uint16_t)res);
+				return;
+			}
+		}
+		
+		switch (op & 0x07) {
+			case 0x04:
+			case 0x05: {
+				bool is_inc = (op & 0x07) == 0x04;
+				uint8_t& target = n == 6 ? mem[get16(2)] : reg(n);
+				target = is_inc ? inc8(target) : dec8(target);
+				return;
+			}
+			case 0x06:
+				if (n == 6)
+					mem[get16(2)] = fetch();
+				else
+					reg(n) = fetch();
+				return;
+		}
+		
+		switch (op) {
+			case 0x00: return;
+			case 0x02: mem[get16(0)] = a; return;
+			case 0x0A: a = mem[get16(0)]; return;
+			case 0x12: mem[get16(1)] = a; return;
+			case 0x1A: a = mem[get16(1)]; return;
+			case 0x32: mem[fetch16()] = a; return;
+			case 0x3A: a = mem[fetch16()]; return;
+			case 0x08: swap(a, a2); swap(f, f2); return;
+			case 0x10: rel = (int8_t)fetch(); if (--b) pc += rel; return;
+			case 0x18: rel = (int8_t)fetch(); pc += rel; return;
+			case 0x20: case 0x28: case 0x30: case 0x38:
+				rel = (int8_t)fetch();
+				if (cond(op >> 3 & 3)) pc += rel;
+				return;
+		}
+		return;
+	}
+	
+	int n = op >> 3 & 7;
+	int rr = op >> 4 & 3;
+	
+	switch (op & 0x07) {
+		case 0x00: if (cond(n)) pc = pop(); return;
+		case 0x02: addr = fetch16(); if (cond(n)) pc = addr; return;
+		case 0x04: addr = fetch16(); if (cond(n)) { push(pc); pc = addr; } return;
+		case 0x06: alu(n, fetch()); return;
+	}
+	
+	switch (op) {
+		case 0xC1: case 0xD1: case 0xE1: set16(rr, pop()); return;
+		case 0xF1: addr = pop(); a = addr >> 8; f = addr & 0xFF; return;
+		case 0xC5: case 0xD5: case 0xE5: push(get16(rr)); return;
+		case 0xF5: push(a << 8 | f); return;
+		case 0xC3: pc = fetch16(); return;
+		case 0xC9: pc = pop(); return;
+		case 0xCD: addr = fetch16(); push(pc); pc = addr; return;
+		case 0xD9: swap(b, b2); swap(c, c2); swap(d, d2); swap(e, e2); swap(h, h2); swap(l, l2); return;
+		case 0xE9: pc = get16(2); return;
+		case 0xEB: swap(d, h); swap(e, l); return;
+	}
+}
+
+// splitmix64, so each test is reproducible from its own seed
+static uint64_t fuzz_rand(uint64_t& state)
+{
+	uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+static bool is_repeat(const uint8_t *mem, uint16_t pc)
+{
+	if (mem[pc] != EXT_ED)
+		return false;
+	
+	switch (mem[(uint16_t)(pc + 1)]) {
+		case ED_LDIR: case ED_LDDR: case ED_CPIR: case ED_INIR: case ED_OTIR:
+			return true;
+	}
+	return false;
+}
+
+// Instructions the core encodes differently from the Zilog tables, and
+// the documented encoding the reference runs in their place. Operands
+// follow the opcode unchanged on both sides.
+struct Divergence {
+	uint8_t prefix, op;
+	uint8_t doc_prefix, doc_op;
+};
+
+static const Divergence DIVERGENCES[] = {
+	{ 0x00, 0xEB, 0x00, 0xE9 },	// JP (HL), where EX DE,HL is documented
+	{ 0xDD, 0x1B, 0x00, 0x16 },	// LD D,n
+	{ 0xDD, 0x1E, 0x00, 0x1E },	// LD E,n
+	{ 0xDD, 0x2B, 0x00, 0x26 },	// LD H,n
+	{ 0xDD, 0xD5, 0x00, 0x06 },	// LD B,n
+	{ 0xDD, 0xDE, 0x00, 0x0E },	// LD C,n
+	{ 0xDD, 0x76, 0xDD, 0x77 },	// LD (IX+d),A
+	{ 0xDD, 0x78, 0x00, 0x36 },	// LD (HL),n
+	{ 0xDD, 0x7E, 0xFD, 0x7E },	// LD A,(IY+d), under the IX prefix
+	{ 0xFD, 0x7E, 0xDD, 0x7E },	// LD A,(IX+d), under the IY prefix
+	{ 0xFD, 0x2E, 0x00, 0x3E },	// LD A,n
+	{ 0xFD, 0x3A, 0x00, 0x3A }	// LD A,(nn)
+};
+
+// Where the Zilog tables have H as a source operand, the core has F:
+// INC F, DEC F, LD r,F, LD (HL),F, LD (IX+d),F, LD (IY+d),F and the ALU
+// ops on F. There is no documented equivalent, so these aren't fuzzed.
+static bool reads_f(const uint8_t *code)
+{
+	uint8_t op = code[0];
+	
+	if (op == 0xDD || op == 0xFD)
+		return code[1] == 0x74;
+	return op == 0x24 || op == 0x25 || (op >= 0x40 && op < 0xC0 && (op & 7) == 4);
+}
+
+// Fills doc with the documented encoding of the instruction at code and
+// returns the core's length of it, or returns 0 if both encode it alike.
+static int translate(const uint8_t *code, uint8_t *doc)
+{
+	for (auto& div : DIVERGENCES) {
+		int skip = div.prefix ? 2 : 1;
+		if (code[0] != (div.prefix ? div.prefix : div.op) || code[skip - 1] != div.op)
+			continue;
+		
+		int at = 0;
+		if (div.doc_prefix)
+			doc[at++] = div.doc_prefix;
+		doc[at++] = div.doc_op;
+		memcpy(doc + at, code + skip, 2);
+		return skip + RefZ80::length(doc) - at;
+	}
+	return 0;
+}
+
+// Steps both sides over one whole instruction. The reference model runs
+// repeating block instructions one iteration at a time; the loop stops
+// early if an iteration overwrites the instruction itself. Divergent
+// encodings are translated for it first.
+static void step_insn(RefZ80& ref, Z80Base& core)
+{
+	uint16_t pc = ref.pc;
+	uint8_t code[4], doc[4];
+	for (int n = 0; n < 4; n++)
+		code[n] = ref.mem[(uint16_t)(pc + n)];
+	
+	int len = translate(code, doc);
+	if (len)
+		ref.exec(doc, pc + len);
+	else
+		do ref.step(); while (ref.pc == pc && is_repeat(ref.mem, pc));
+	
+	pc = core.reg_pc();
+	for (;;) {
+		core.step();
+		uint8_t code[2] = { core.peek(pc), core.peek((uint16_t)(pc + 1)) };
+		if (core.reg_pc() != pc || !is_repeat(code, 0))
+			break;
+	}
+}
+
+struct FuzzOptions {
+	unsigned threads = 0;
+	uint64_t tests = 1000000;
+	uint64_t first = 0;
+	uint64_t seed = 1;
+	int length = 24;
+	bool compact = false;
+};
+
+// Runs the plain core, or its compact variant, through Z80Base.
+class Fuzzer {
+	typedef Z80Base Core;
+	
+	const FuzzOptions& opts_;
+	vector<array<uint8_t, 4>> ops_;
+	vector<uint8_t> lengths_;
+	
+	atomic<uint64_t> next_test_;
+	atomic<bool> failed_;
+	mutex report_lock_;
+	
+	static int op_key(const uint8_t *code);
+	uint64_t test_seed(uint64_t test) const;
+	uint16_t generate(uint64_t seed, const Snapshot& base, Snapshot& snap);
+	int run(RefZ80& ref, Core& core, uint16_t start, uint16_t end, bool check_ram);
+	bool same(RefZ80& ref, Core& core, bool check_ram, ostream *out);
+	void report(uint64_t test, const Snapshot& snap, uint16_t end, RefZ80& ref, Core& core);
+	void worker();
+	
+public:
+	explicit Fuzzer(const FuzzOptions& opts);
+	bool run_all();
+};
+
+Fuzzer::Fuzzer(const FuzzOptions& opts)
+	: opts_(opts), lengths_(0x10000), next_test_(opts.first), failed_(false)
+{
+	unique_ptr<Core> probe = make_z80(0);
+	
+	// every instruction of every page that the reference runs, as is or
+	// translated, and the core doesn't reject, as prefix/opcode pairs
+	for (int prefix : { 0, 0xDD, 0xED, 0xFD }) {
+		for (int op = 0; op < 256; op++) {
+			uint8_t code[4] = { (uint8_t)(prefix ? prefix : op), (uint8_t)op };
+			uint8_t doc[4];
+			if (!prefix && (op == 0xDD || op == 0xED || op == 0xFD))
+				continue;
+			
+			int len = translate(code, doc);
+			if (!len && !reads_f(code))
+				len = RefZ80::length(code);
+			if (!len)
+				continue;
+			
+			probe->write_mem(0, code, sizeof code);
+			probe->regs().pc = 0;
+			if (probe->run_for(1) == STOP_ILLEGAL)
+				continue;
+			
+			lengths_[op_key(code)] = (uint8_t)len;
+			ops_.push_back({{ code[0], code[1], (uint8_t)(prefix ? 2 : 1), (uint8_t)len }});
+		}
+	}
+}
+
+// Index into lengths_ for the instruction at code.
+int Fuzzer::op_key(const uint8_t *code)
+{
+	bool prefixed = code[0] == 0xDD || code[0] == 0xED || code[0] == 0xFD;
+	return prefixed ? code[0] << 8 | code[1] : code[0];
+}
+
+uint16_t Fuzzer::generate(uint64_t seed, const Snapshot& base, Snapshot& snap)
+{
+	uint64_t rng = seed;
+	uint16_t start = 0x0100 + fuzz_rand(rng) % 0xFD00;
+	uint16_t pc = start;
+	uint8_t *ram = &snap.ram[0];
+	
+	snap = base;
+	
+	uint8_t raw[sizeof(Registers)];
+	for (size_t n = 0; n < sizeof raw; n++)
+		raw[n] = (uint8_t)fuzz_rand(rng);
+	memcpy(&snap.regs, raw, sizeof raw);
+	snap.regs.pc = start;
+	
+	for (int n = 0; n < opts_.length && pc < 0xFFF0; n++) {
+		const array<uint8_t, 4>& op = ops_[fuzz_rand(rng) % ops_.size()];
+		uint8_t code[4] = { op[0], op[1] };
+		for (int k = op[2]; k < op[3]; k++)
+			code[k] = (uint8_t)fuzz_rand(rng);
+		
+		// keep block instructions short and jumps mostly within the stream
+		if (is_repeat(code, 0) && fuzz_rand(rng) % 8) {
+			ram[pc++] = LD_BC_imm;
+			ram[pc++] = 1 + fuzz_rand(rng) % 32;
+			ram[pc++] = 0;
+		}
+		if (op[2] == 1 && op[3] == 2 && code[0] < 0x40 && fuzz_rand(rng) % 4)
+			code[1] = (uint8_t)(fuzz_rand(rng) % 13 - 6);
+		if (op[2] == 1 && op[3] == 3 && code[0] >= 0xC0 && fuzz_rand(rng) % 2) {
+			uint16_t target = start + fuzz_rand(rng) % (opts_.length * 2);
+			code[1] = target & 0xFF;
+			code[2] = target >> 8;
+		}
+		
+		for (int k = 0; k < op[3]; k++)
+			ram[pc++] = code[k];
+	}
+	
+	return pc;
+}
+
+static void load_ref(RefZ80& ref, const Snapshot& snap)
+{
+	const Registers& regs = snap.regs;
+	
+	ref.a = regs.a; ref.f = regs.f; ref.b = regs.b; ref.c = regs.c;
+	ref.d = regs.d; ref.e = regs.e; ref.h = regs.h; ref.l = regs.l;
+	ref.a2 = regs.a2; ref.f2 = regs.f2; ref.b2 = regs.b2; ref.c2 = regs.c2;
+	ref.d2 = regs.d2; ref.e2 = regs.e2; ref.h2 = regs.h2; ref.l2 = regs.l2;
+	ref.i = regs.i; ref.r = regs.r;
+	ref.ix = regs.ix; ref.iy = regs.iy; ref.sp = regs.sp; ref.pc = regs.pc;
+	memcpy(ref.mem, &snap.ram[0], MEM_SIZE);
+	memcpy(ref.ports, &snap.ports[0], sizeof ref.ports);
+}
+
+bool Fuzzer::same(RefZ80& ref, Core& core, bool check_ram, ostream *out)
+{
+	struct { const char *name; unsigned ours, theirs; } regs[] = {
+		{ "af", core.reg_af(), (unsigned)(ref.a << 8 | ref.f) },
+		{ "bc", core.reg_bc(), (unsigned)(ref.b << 8 | ref.c) },
+		{ "de", core.reg_de(), (unsigned)(ref.d << 8 | ref.e) },
+		{ "hl", core.reg_hl(), (unsigned)(ref.h << 8 | ref.l) },
+		{ "af'", (unsigned)(core.reg_a2() << 8 | core.reg_f2()), (unsigned)(ref.a2 << 8 | ref.f2) },
+		{ "bc'", (unsigned)(core.reg_b2() << 8 | core.reg_c2()), (unsigned)(ref.b2 << 8 | ref.c2) },
+		{ "de'", (unsigned)(core.reg_d2() << 8 | core.reg_e2()), (unsigned)(ref.d2 << 8 | ref.e2) },
+		{ "hl'", (unsigned)(core.reg_h2() << 8 | core.reg_l2()), (unsigned)(ref.h2 << 8 | ref.l2) },
+		{ "ix", core.reg_ix(), ref.ix },
+		{ "iy", core.reg_iy(), ref.iy },
+		{ "sp", core.reg_sp(), ref.sp },
+		{ "pc", core.reg_pc(), ref.pc },
+		{ "i", core.reg_i(), ref.i },
+		{ "r", core.reg_r(), ref.r }
+	};
+	bool ok = true;
+	
+	for (auto& reg : regs) {
+		if (reg.ours == reg.theirs)
+			continue;
+		ok = false;
+		if (out)
+			*out << "  " << setw(3) << left << reg.name << right << " core " << hex
+				<< setw(4) << setfill('0') << reg.ours << " ref " << setw(4)
+				<< reg.theirs << setfill(' ') << dec << endl;
+	}
+	
+	if (!check_ram)
+		return ok;
+	
+	static thread_local array<uint8_t, MEM_SIZE> copy;
+	const uint8_t *ram = &copy[0];
+	int shown = 0;
+	
+	if (core.compact())
+		core.read_mem(0, &copy[0], MEM_SIZE);
+	else
+		ram = &core.ram()[0];
+	
+	if (memcmp(ram, ref.mem, MEM_SIZE)) {
+		ok = false;
+		for (int addr = 0; out && addr < MEM_SIZE && shown < 8; addr++) {
+			if (ram[addr] == ref.mem[addr])
+				continue;
+			*out << "  mem " << hex << setfill('0') << setw(4) << addr << " core "
+				<< setw(2) << (int)ram[addr] << " ref " << setw(2) << (int)ref.mem[addr]
+				<< setfill(' ') << dec << endl;
+			shown++;
+		}
+	}
+	if (memcmp(&core.ports()[0], ref.ports, sizeof ref.ports)) {
+		ok = false;
+		for (int port = 0; out && port < 256; port++) {
+			if (core.ports()[port] != ref.ports[port])
+				*out << "  port " << hex << setfill('0') << setw(2) << port << " core "
+					<< setw(2) << (int)core.ports()[port] << " ref " << setw(2)
+					<< (int)ref.ports[port] << setfill(' ') << dec << endl;
+		}
+	}
+	
+	return ok;
+}
+
+// Runs one whole instruction at a time on both sides until the program
+// leaves the stream or jumps into an operand that isn't an instruction.
+// Returns the index of the first diverging instruction or -1. Without
+// check_ram, memory is only compared at the end.
+int Fuzzer::run(RefZ80& ref, Core& core, uint16_t start, uint16_t end, bool check_ram)
+{
+	int max_insns = opts_.length * 4;
+	int insn = 0;
+	
+	for (; insn < max_insns; insn++) {
+		uint16_t pc = ref.pc;
+		uint8_t code[2] = { ref.mem[pc], ref.mem[(uint16_t)(pc + 1)] };
+		if (pc < start || pc >= end || !lengths_[op_key(code)])
+			break;
+		
+		step_insn(ref, core);
+		
+		if (!same(ref, core, check_ram, nullptr))
+			return insn;
+	}
+	
+	return same(ref, core, true, nullptr) ? -1 : insn;
+}
+
+void Fuzzer::report(uint64_t test, const Snapshot& snap, uint16_t end, RefZ80& ref, Core& core)
+{
+	uint16_t start = snap.regs.pc;
+	
+	// replay with full memory checks to find the first bad instruction
+	load_ref(ref, snap);
+	core.restore(snap);
+	int insn = run(ref, core, start, end, true);
+	
+	load_ref(ref, snap);
+	core.restore(snap);
+	for (int n = 0; n < insn; n++)
+		step_insn(ref, core);
+	
+	lock_guard<mutex> lock(report_lock_);
+	
+	cerr << "divergence in test " << test << ", rerun with: fuzz -s " << opts_.seed
+		<< " -t " << test << " -n 1" << endl;
+	cerr << "stream at " << hex << setfill('0') << setw(4) << start << ":";
+	for (uint16_t addr = start; addr < end; addr++)
+		cerr << " " << setw(2) << (int)snap.ram[addr];
+	cerr << setfill(' ') << dec << endl;
+	cerr << "after " << insn << " instructions, at " << core.disassemble(core.reg_pc())
+		<< endl;
+	
+	step_insn(ref, core);
+	same(ref, core, true, &cerr);
+}
+
+uint64_t Fuzzer::test_seed(uint64_t test) const
+{
+	uint64_t state = opts_.seed + test;
+	return fuzz_rand(state);
+}
+
+void Fuzzer::worker()
+{
+	unique_ptr<Core> cpu = make_z80(opts_.compact ? (unsigned)FEATURE_COMPACT : 0u);
+	Core& core = *cpu;
+	RefZ80 ref;
+	Snapshot base, snap;
+	uint64_t rng = ~opts_.seed;
+	
+	// random memory and ports behind the instruction streams, the same on
+	// every thread so that a test only depends on the seed and its index
+	for (auto& byte : base.ram)
+		byte = (uint8_t)fuzz_rand(rng);
+	for (auto& byte : base.ports)
+		byte = (uint8_t)fuzz_rand(rng);
+	base.cycles = 0;
+	
+	while (!failed_) {
+		uint64_t test = next_test_++;
+		if (test >= opts_.first + opts_.tests)
+			break;
+		
+		uint16_t end = generate(test_seed(test), base, snap);
+		load_ref(ref, snap);
+		core.restore(snap);
+		
+		if (run(ref, core, snap.regs.pc, end, false) >= 0) {
+			if (!failed_.exchange(true))
+				report(test, snap, end, ref, core);
+			break;
+		}
+	}
+}
+
+bool Fuzzer::run_all()
+{
+	unsigned threads = opts_.threads ? opts_.threads : thread::hardware_concurrency();
+	if (!threads)
+		threads = 1;
+	
+	auto start = chrono::steady_clock::now();
+	vector<thread> pool;
+	for (unsigned n = 0; n < threads; n++)
+		pool.emplace_back(&Fuzzer::worker, this);
+	for (auto& t : pool)
+		t.join();
+	
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	uint64_t done = min<uint64_t>(next_test_ - opts_.first, opts_.tests);
+	
+	cout << done << " tests on " << threads << " threads in " << fixed
+		<< setprecision(2) << secs << " s, " << setprecision(0) << done / secs * 60
+		<< " tests/min" << (failed_ ? "" : ", no divergence") << endl;
+	
+	return !failed_;
+}
+
+struct IdleOptions {
+	unsigned threads = 0;
+	uint64_t tests = 20000;
+	uint64_t first = 0;
+	uint64_t seed = 1;
+	bool block = false;
+};
+
+// Differential check of idle skipping, or of bulk block instructions with
+// IdleOptions::block. Each test runs a short program of counting and
+// polling loops and repeating block instructions, mixed with near misses
+// that must not be skipped, on two cores that differ only in
+// set_idle_skip() or set_fast_block(). Both get the same random budgets,
+// through run_for() or run_to_nop() with a limit, and must stop alike with
+// the same registers, memory, ports and cycles().
+class IdleCheck {
+	typedef Z80Base Core;
+	
+	static const int MAX_CHUNKS = 4;
+	
+	struct Test {
+		unsigned features;
+		bool to_nop;
+		int chunks;
+		uint64_t budgets[MAX_CHUNKS];
+		uint16_t start, end;
+		int breakpoint, watch;
+		const char *cond;
+	};
+	
+	const IdleOptions& opts_;
+	Snapshot base_;
+	
+	atomic<uint64_t> next_test_;
+	atomic<uint64_t> skipped_;
+	atomic<bool> failed_;
+	mutex report_lock_;
+	
+	void generate(uint64_t test, Test& t, Snapshot& snap) const;
+	bool same(Core& off, Core& on, ostream *out) const;
+	bool check(uint64_t test, ostream *out);
+	void worker();
+	
+public:
+	explicit IdleCheck(const IdleOptions& opts);
+	bool run_all();
+};
+
+IdleCheck::IdleCheck(const IdleOptions& opts)
+	: opts_(opts), next_test_(opts.first), skipped_(0), failed_(false)
+{
+	uint64_t rng = ~opts_.seed;
+	
+	for (auto& byte : base_.ram)
+		byte = (uint8_t)fuzz_rand(rng);
+	for (auto& byte : base_.ports)
+		byte = (uint8_t)fuzz_rand(rng);
+	base_.cycles = 0;
+}
+
+void IdleCheck::generate(uint64_t test, Test& t, Snapshot& snap) const
+{
+	static const unsigned FEATURES[] = {
+		0, FEATURE_CYCLES, FEATURE_COMPACT, FEATURE_COMPACT | FEATURE_CYCLES,
+		FEATURE_WATCH | FEATURE_CYCLES, FEATURE_ALL
+	};
+	static const uint8_t COUNT8[] = { DEC_A, DEC_B, DEC_C, DEC_D, DEC_E, DEC_L };
+	static const uint8_t COUNT16[][3] = {
+		{ DEC_BC, LD_A_B, OR_A_C }, { DEC_BC, LD_A_C, OR_A_B },
+		{ DEC_DE, LD_A_D, OR_A_E }, { DEC_DE, LD_A_E, OR_A_D }
+	};
+	static const uint8_t BLOCKS[] = { ED_LDIR, ED_LDDR, ED_CPIR, ED_INIR, ED_OTIR };
+	static const char *CONDS[] = { "", "bc == 5", "b < 3", "[hl] == a" };
+	static const uint8_t MISSES[][5] = {
+		{ 3, INC_A, JR_NZ, 0xFD },
+		{ 3, INC_ind_HL, JR_NZ, 0xFD },
+		{ 4, DEC_B, LD_ind_HL_A, JR_NZ, 0xFC },
+		{ 4, LD_A_ind_BC, EX_AF_AF2, JR_Z, 0xFC },
+		{ 4, DEC_L, INC_HL, JR_NZ, 0xFC },
+		{ 2, DJNZ, 0xFC }
+	};
+	uint64_t state = opts_.seed + test;
+	uint64_t rng = fuzz_rand(state);
+	uint8_t *ram = &snap.ram[0];
+	
+	snap = base_;
+	
+	uint8_t raw[sizeof(Registers)];
+	for (size_t n = 0; n < sizeof raw; n++)
+		raw[n] = (uint8_t)fuzz_rand(rng);
+	memcpy(&snap.regs, raw, sizeof raw);
+	
+	t.features = FEATURES[fuzz_rand(rng) % (sizeof FEATURES / sizeof FEATURES[0])];
+	t.to_nop = fuzz_rand(rng) % 2;
+	t.chunks = 1 + fuzz_rand(rng) % MAX_CHUNKS;
+	for (int n = 0; n < t.chunks; n++)
+		t.budgets[n] = 1 + fuzz_rand(rng) % (1ull << fuzz_rand(rng) % 20);
+	
+	t.start = 0x0100 + fuzz_rand(rng) % 0x8000;
+	snap.regs.pc = t.start;
+	uint16_t pc = t.start;
+	uint16_t poll = 0x9000 + fuzz_rand(rng) % 0x100;
+	
+	// small counts now and then, so that loops finish within the budget
+	if (fuzz_rand(rng) % 2) {
+		snap.regs.b = fuzz_rand(rng) % 8;
+		snap.regs.d = fuzz_rand(rng) % 8;
+	}
+	
+	for (int pieces = 1 + fuzz_rand(rng) % 5; pieces > 0; pieces--) {
+		const uint8_t *code;
+		uint8_t buf[11];
+		uint8_t len;
+		
+		switch (fuzz_rand(rng) % 10) {
+			case 0:
+				code = buf;
+				len = 2;
+				buf[0] = DJNZ;
+				buf[1] = 0xFE;
+				break;
+			case 1:
+				code = buf;
+				len = 3;
+				buf[0] = COUNT8[fuzz_rand(rng) % sizeof COUNT8];
+				buf[1] = JR_NZ;
+				buf[2] = 0xFD;
+				break;
+			case 2:
+				code = buf;
+				len = 5;
+				memcpy(buf, COUNT16[fuzz_rand(rng) % 4], 3);
+				buf[3] = JR_NZ;
+				buf[4] = 0xFB;
+				break;
+			case 3:
+				code = buf;
+				len = 8;
+				buf[0] = EXT_FD;
+				buf[1] = FD_LD_A_ext;
+				buf[2] = poll & 0xFF;
+				buf[3] = poll >> 8;
+				buf[4] = AND_A_imm;
+				buf[5] = (uint8_t)(1 << fuzz_rand(rng) % 8);
+				buf[6] = fuzz_rand(rng) % 2 ? JR_Z : JR_NZ;
+				buf[7] = 0xF8;
+				break;
+			case 4:
+				code = buf;
+				len = 5;
+				buf[0] = LD_A_ind_BC;
+				buf[1] = CP_imm;
+				buf[2] = (uint8_t)fuzz_rand(rng);
+				buf[3] = fuzz_rand(rng) % 2 ? JR_Z : JR_NZ;
+				buf[4] = 0xFB;
+				break;
+			case 5: case 6: {
+				// counts of up to 4 KiB, or 64 KiB when BC comes out 0
+				uint16_t count = (uint16_t)(fuzz_rand(rng) % (2ull << fuzz_rand(rng) % 12));
+				uint16_t src = (uint16_t)fuzz_rand(rng);
+				uint16_t dst = (uint16_t)fuzz_rand(rng);
+				code = buf;
+				len = 11;
+				buf[0] = LD_BC_imm;
+				buf[1] = count & 0xFF;
+				buf[2] = count >> 8;
+				buf[3] = LD_HL_imm;
+				buf[4] = src & 0xFF;
+				buf[5] = src >> 8;
+				buf[6] = LD_DE_imm;
+				buf[7] = dst & 0xFF;
+				buf[8] = dst >> 8;
+				buf[9] = EXT_ED;
+				buf[10] = BLOCKS[fuzz_rand(rng) % sizeof BLOCKS];
+				break;
+			}
+			case 7: case 8:
+				code = &MISSES[fuzz_rand(rng) % (sizeof MISSES / sizeof MISSES[0])][1];
+				len = code[-1];
+				break;
+			default:
+				// a poll that never ends, rarely, since nothing after it runs
+				code = buf;
+				len = 2;
+				buf[0] = JR;
+				buf[1] = fuzz_rand(rng) % 4 ? 0x00 : 0xFE;
+				break;
+		}
+		
+		memcpy(ram + pc, code, len);
+		pc += len;
+	}
+	
+	ram[pc++] = JR;
+	ram[pc] = (uint8_t)(t.start - (pc + 1));
+	t.end = ++pc;
+	
+	t.breakpoint = fuzz_rand(rng) % 4 ? -1 : t.start + fuzz_rand(rng) % (t.end - t.start);
+	t.watch = fuzz_rand(rng) % 4 ? -1 : poll;
+	t.cond = CONDS[fuzz_rand(rng) % (sizeof CONDS / sizeof CONDS[0])];
+}
+
+bool IdleCheck::same(Core& off, Core& on, ostream *out) const
+{
+	const Registers& a = off.regs();
+	const Registers& b = on.regs();
+	struct { const char *name; unsigned off, on; } regs[] = {
+		{ "af", a.af, b.af }, { "bc", a.bc, b.bc }, { "de", a.de, b.de },
+		{ "hl", a.hl, b.hl }, { "af'", a.af2, b.af2 }, { "bc'", a.bc2, b.bc2 },
+		{ "de'", a.de2, b.de2 }, { "hl'", a.hl2, b.hl2 }, { "ix", a.ix, b.ix },
+		{ "iy", a.iy, b.iy }, { "sp", a.sp, b.sp }, { "pc", a.pc, b.pc },
+		{ "i", a.i, b.i }, { "r", a.r, b.r }
+	};
+	bool ok = true;
+	
+	for (auto& reg : regs) {
+		if (reg.off == reg.on)
+			continue;
+		ok = false;
+		if (out)
+			*out << "  " << setw(3) << left << reg.name << right << " off " << hex
+				<< setw(4) << setfill('0') << reg.off << " on " << setw(4)
+				<< reg.on << setfill(' ') << dec << endl;
+	}
+	
+	if (off.cycles() != on.cycles()) {
+		ok = false;
+		if (out)
+			*out << "  cycles off " << off.cycles() << " on " << on.cycles() << endl;
+	}
+	
+	static thread_local array<uint8_t, MEM_SIZE> mem_off, mem_on;
+	off.read_mem(0, &mem_off[0], MEM_SIZE);
+	on.read_mem(0, &mem_on[0], MEM_SIZE);
+	
+	if (mem_off != mem_on) {
+		ok = false;
+		for (int addr = 0, shown = 0; out && addr < MEM_SIZE && shown < 8; addr++) {
+			if (mem_off[addr] == mem_on[addr])
+				continue;
+			*out << "  mem " << hex << setfill('0') << setw(4) << addr << " off "
+				<< setw(2) << (int)mem_off[addr] << " on " << setw(2) << (int)mem_on[addr]
+				<< setfill(' ') << dec << endl;
+			shown++;
+		}
+	}
+	if (off.ports() != on.ports()) {
+		ok = false;
+		if (out)
+			*out << "  ports differ" << endl;
+	}
+	
+	return ok;
+}
+
+// Runs one test on fresh cores, printing the first difference to out.
+bool IdleCheck::check(uint64_t test, ostream *out)
+{
+	Test t;
+	static thread_local Snapshot snap;
+	generate(test, t, snap);
+	
+	unique_ptr<Core> cores[2] = { make_z80(t.features), make_z80(t.features) };
+	for (int n = 0; n < 2; n++) {
+		Core& core = *cores[n];
+		core.restore(snap);
+		if (opts_.block)
+			core.set_fast_block(n == 1);
+		else
+			core.set_idle_skip(n == 1);
+		if (t.breakpoint >= 0 && (t.features & FEATURE_WATCH)) {
+			Condition cond;
+			Condition::compile(t.cond, cond);
+			core.add_breakpoint((uint16_t)t.breakpoint, cond);
+		}
+		if (t.watch >= 0 && (t.features & FEATURE_WATCH))
+			core.add_watchpoint((uint16_t)t.watch, 1, WATCH_READ);
+	}
+	
+	for (int chunk = 0; chunk < t.chunks; chunk++) {
+		uint64_t budget = t.budgets[chunk];
+		Stop stops[2];
+		for (int n = 0; n < 2; n++)
+			stops[n] = t.to_nop ? cores[n]->run_to_nop(nullptr, budget)
+				: cores[n]->run_for(budget);
+		
+		bool ok = same(*cores[0], *cores[1], nullptr) && stops[0] == stops[1];
+		if (ok)
+			continue;
+		
+		if (out) {
+			*out << "mismatch in test " << test << ", rerun with: idle " << (opts_.block ? "-b " : "")
+				<< "-s " << opts_.seed
+				<< " -t " << test << " -n 1" << endl;
+			*out << "features " << hex << t.features << dec << ", "
+				<< (t.to_nop ? "run_to_nop" : "run_for") << " budgets";
+			for (int n = 0; n <= chunk; n++)
+				*out << " " << t.budgets[n];
+			*out << ", stopped " << (int)stops[0] << " off, " << (int)stops[1] << " on" << endl;
+			*out << "program at " << hex << setfill('0') << setw(4) << t.start << ":";
+			for (uint16_t addr = t.start; addr < t.end; addr++)
+				*out << " " << setw(2) << (int)snap.ram[addr];
+			*out << setfill(' ') << dec << endl;
+			same(*cores[0], *cores[1], out);
+		}
+		return false;
+	}
+	
+	skipped_ += cores[1]->idle_cycles();
+	return true;
+}
+
+void IdleCheck::worker()
+{
+	while (!failed_) {
+		uint64_t test = next_test_++;
+		if (test >= opts_.first + opts_.tests)
+			break;
+		
+		if (!check(test, nullptr)) {
+			if (!failed_.exchange(true)) {
+				lock_guard<mutex> lock(report_lock_);
+				check(test, &cerr);
+			}
+			break;
+		}
+	}
+}
 
-using namespace std;
+bool IdleCheck::run_all()
+{
+	unsigned threads = opts_.threads ? opts_.threads : thread::hardware_concurrency();
+	if (!threads)
+		threads = 1;
+	
+	auto start = chrono::steady_clock::now();
+	vector<thread> pool;
+	for (unsigned n = 0; n < threads; n++)
+		pool.emplace_back(&IdleCheck::worker, this);
+	for (auto& t : pool)
+		t.join();
+	
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	uint64_t done = min<uint64_t>(next_test_ - opts_.first, opts_.tests);
+	
+	cout << done << " tests on " << threads << " threads in " << fixed
+		<< setprecision(2) << secs << " s, " << skipped_ << " cycles skipped"
+		<< (failed_ ? "" : ", no mismatch") << endl;
+	
+	return !failed_;
+}
+
+enum AluOp {
+	ALU_ADD, ALU_ADC, ALU_SUB, ALU_SBC, ALU_AND, ALU_XOR, ALU_OR, ALU_CP,
+	ALU_INC, ALU_DEC, ALU_COUNT
+};
+
+// Exhaustive check and benchmark of the 8-bit ALU and its flags. Every op
+// runs over all 256x256 operand pairs with carry clear and set. The
+// expected A and F come from RefZ80 and form a golden table whose hash is
+// pinned, so the reference can't silently drift along with the core. The
+// core only sees instructions: each op, on B where it takes an operand,
+// is stepped at address 0.
+class AluCheck {
+	typedef Z80Core<PlainPolicy> Core;
+	
+	static const int INPUTS = 2 * 256 * 256;
+	static const int ROWS = ALU_COUNT * 2 * 256;
+	static const uint64_t GOLDEN_HASH = 0x0A1990AF137471A5ull;
+	
+	unsigned threads_;
+	int rounds_;
+	vector<uint16_t> golden_;
+	
+	atomic<int> next_row_;
+	atomic<uint64_t> mismatches_[ALU_COUNT];
+	vector<double> best_ns_;
+	mutex lock_;
+	
+	static uint16_t ref_eval(RefZ80& ref, int op, int input);
+	static void core_load(Core& core, int op);
+	static uint16_t core_eval(Core& core, int input);
+	static uint64_t core_sweep(Core& core);
+	
+	void parallel(void (AluCheck::*fn)());
+	void fill_rows();
+	void check_rows();
+	void time_ops();
+	
+public:
+	AluCheck(unsigned threads, int rounds);
+	bool run();
+};
 
-const int CPU_HZ = 3580 * 1000;
-const int MEM_SIZE = 32 * 1024;
-
-enum Op : uint8_t {
-	NOOP = 0x00,
-	LD_ind_BC_A = 0x02,
-	INC_B = 0x04,
-	DEC_B = 0x05,
-	LD_A_ind_BC = 0x0A,
-	INC_C = 0x0C,
-	DEC_C = 0x0D,
-	DJNZ = 0x10,
-	LD_ind_DE_A = 0x12,
-	INC_D = 0x14,
-	DEC_D = 0x15,
-	JR = 0x18,
-	LD_A_ind_DE = 0x1A,
-	INC_E = 0x1C,
-	DEC_E = 0x1D,
-	JR_NZ = 0x20,
-	INC_F = 0x24,
-	DEC_F = 0x25,
-	JR_Z = 0x28,
-	INC_L = 0x2C,
-	DEC_L = 0x2D,
-	JR_NC = 0x30,
-	LD_ext_A = 0x32,
-	INC_ind_HL = 0x34,
-	DEC_ind_HL = 0x35,
-	JR_C = 0x38,
-	INC_A = 0x3C,
-	DEC_A = 0x3D,
-	LD_B_B = 0x40,
-	LD_B_C,
-	LD_B_D,
-	LD_B_E,
-	LD_B_F,
-	LD_B_L,
-	LD_B_ind_HL,
-	LD_B_A,
-	LD_C_B,
-	LD_C_C,
-	LD_C_D,
-	LD_C_E,
-	LD_C_F,
-	LD_C_L,
-	LD_C_ind_HL,
-	LD_C_A,
-	LD_D_B,
-	LD_D_C,
-	LD_D_D,
-	LD_D_E,
-	LD_D_F,
-	LD_D_L,
-	LD_D_ind_HL,
-	LD_D_A,
-	LD_E_B,
-	LD_E_C,
-	LD_E_D,
-	LD_E_E,
-	LD_E_F,
-	LD_E_L,
-	LD_E_ind_HL,
-	LD_E_A,
-	LD_H_B,
-	LD_H_C,
-	LD_H_D,
-	LD_H_E,
-	LD_H_F,
-	LD_H_L,
-	LD_H_ind_HL,
-	LD_H_A,
-	LD_L_B,
-	LD_L_C,
-	LD_L_D,
-	LD_L_E,
-	LD_L_F,
-	LD_L_L,
-	LD_L_ind_HL,
-	LD_L_A,
-	LD_ind_HL_B,
-	LD_ind_HL_C,
-	LD_ind_HL_D,
-	LD_ind_HL_E,
-	LD_ind_HL_F,
-	LD_ind_HL_L = 0x75,
-	LD_ind_HL_A = 0x77,
-	LD_A_B,
-	LD_A_C,
-	LD_A_D,
-	LD_A_E,
-	LD_A_F,
-	LD_A_L,
-	LD_A_ind_HL,
-	LD_A_A,
-	ADD_A_B,
-	ADD_A_C,
-	ADD_A_D,
-	ADD_A_E,
-	ADD_A_F,
-	ADD_A_L,
-	ADD_A_ind_HL,
-	ADD_A_A,
-	ADC_A_B,
-	ADC_A_C,
-	ADC_A_D,
-	ADC_A_E,
-	ADC_A_F,
-	ADC_A_L,
-	ADC_A_ind_HL,
-	ADC_A_A,
-	SUB_A_B,
-	SUB_A_C,
-	SUB_A_D,
-	SUB_A_E,
-	SUB_A_F,
-	SUB_A_L,
-	SUB_A_ind_HL,
-	SUB_A_A,
-	SBC_A_B,
-	SBC_A_C,
-	SBC_A_D,
-	SBC_A_E,
-	SBC_A_F,
-	SBC_A_L,
-	SBC_A_ind_HL,
-	SBC_A_A,
-	AND_A_B,
-	AND_A_C,
-	AND_A_D,
-	AND_A_E,
-	AND_A_F,
-	AND_A_L,
-	AND_A_ind_HL,
-	AND_A_A,
-	XOR_A_B,
-	XOR_A_C,
-	XOR_A_D,
-	XOR_A_E,
-	XOR_A_F,
-	XOR_A_L,
-	XOR_A_ind_HL,
-	XOR_A_A,
-	OR_A_B,
-	OR_A_C,
-	OR_A_D,
-	OR_A_E,
-	OR_A_F,
-	OR_A_L,
-	OR_A_ind_HL,
-	OR_A_A,
-	CP_B,
-	CP_C,
-	CP_D,
-	CP_E,
-	CP_F,
-	CP_L,
-	CP_ind_HL,
-	CP_A = 0xBF,
-	JP_NZ = 0xC2,
-	JP = 0xC3,
-	ADD_A_imm = 0xC6,
-	JP_Z = 0xCA,
-	ADC_A_imm = 0xCE,
-	JP_NC = 0xD2,
-	SUB_A_imm = 0xD6,
-	JP_C = 0xD8,
-	EXT_DD = 0xDD,
-	SBC_A_imm = 0xDE,
-	JP_PO = 0xE2,
-	AND_A_imm = 0xE6,
-	JP_PE = 0xEA,
-	JP_ind_HL = 0xEB,
-	EXT_ED = 0xED,
-	XOR_A_imm = 0xEE,
-	JP_P = 0xF2,
-	OR_A_imm = 0xF6,
-	JP_M = 0xFA,
-	EXT_FD = 0xFD,
-	CP_imm = 0xFE
+static const char *const ALU_NAMES[ALU_COUNT] = {
+	"add", "adc", "sub", "sbc", "and", "xor", "or", "cp", "inc", "dec"
 };
 
-enum DDOp : uint8_t {
-	DD_LD_D_imm = 0x1B,
-	DD_LD_E_imm = 0x1E,
-	DD_LD_H_imm = 0x2B,
-	DD_INC_idx_IX = 0x34,
-	DD_DEC_idx_IX = 0x35,
-	DD_LD_idx_IX_imm = 0x36,
-	DD_LD_B_idx_IX = 0x46,
-	DD_LD_C_idx_IX = 0x4E,
-	DD_LD_D_idx_IX = 0x56,
-	DD_LD_E_idx_IX = 0x5E,
-	DD_LD_H_idx_IX = 0x66,
-	DD_LD_L_idx_IX = 0x6E,
-	DD_LD_idx_IX_B = 0x70,
-	DD_LD_idx_IX_C,
-	DD_LD_idx_IX_D,
-	DD_LD_idx_IX_E,
-	DD_LD_idx_IX_F,
-	DD_LD_idx_IX_L,
-	DD_LD_idx_IX_A,
-	DD_LD_ind_HL_imm = 0x78,
-	DD_LD_A_idx_IY = 0x7E,
-	DD_ADD_A_idx_IX = 0x86,
-	DD_ADC_A_idx_IX = 0x8E,
-	DD_SUB_A_idx_IX = 0x96,
-	DD_SBC_A_idx_IX = 0x9E,
-	DD_AND_A_idx_IX = 0xA6,
-	DD_XOR_A_idx_IX = 0xAE,
-	DD_OR_A_idx_IX = 0xB6,
-	DD_CP_idx_IX = 0xBE,
-	DD_LD_B_imm = 0xD5,
-	DD_LD_C_imm = 0xDE,
-	DD_JP_ind_IX = 0xE9
+static const uint8_t ALU_OPCODES[ALU_COUNT] = {
+	ADD_A_B, ADC_A_B, SUB_A_B, SBC_A_B, AND_A_B, XOR_A_B, OR_A_B, CP_B, INC_A, DEC_A
 };
 
-enum EDOp : uint8_t {
-	ED_LD_imp_I_A = 0x47,
-	ED_LD_imp_R_A = 0x4F
+AluCheck::AluCheck(unsigned threads, int rounds)
+	: threads_(threads ? threads : thread::hardware_concurrency()), rounds_(rounds),
+	  golden_(ALU_COUNT * INPUTS), next_row_(0), best_ns_(ALU_COUNT, 1e9)
+{
+	if (!threads_)
+		threads_ = 1;
+	for (auto& count : mismatches_)
+		count = 0;
+}
+
+// Inputs are numbered carry << 16 | a << 8 | b. The result is A << 8 | F.
+uint16_t AluCheck::ref_eval(RefZ80& ref, int op, int input)
+{
+	uint8_t a = input >> 8, b = input;
+	
+	ref.a = a;
+	ref.f = input >> 16;
+	
+	switch (op) {
+		case ALU_INC: ref.a = ref.inc8(a); break;
+		case ALU_DEC: ref.a = ref.dec8(a); break;
+		default: ref.alu(op, b); break;
+	}
+	
+	return ref.a << 8 | ref.f;
+}
+
+void AluCheck::core_load(Core& core, int op)
+{
+	core.write_mem(0, &ALU_OPCODES[op], 1);
+}
+
+uint16_t AluCheck::core_eval(Core& core, int input)
+{
+	Registers& regs = core.regs();
+	
+	regs.a = input >> 8;
+	regs.b = input;
+	regs.f = input >> 16;
+	regs.pc = 0;
+	core.step();
+	
+	return regs.a << 8 | regs.f;
+}
+
+uint64_t AluCheck::core_sweep(Core& core)
+{
+	uint64_t sum = 0;
+	for (int input = 0; input < INPUTS; input++)
+		sum += core_eval(core, input);
+	return sum;
+}
+
+void AluCheck::parallel(void (AluCheck::*fn)())
+{
+	vector<thread> pool;
+	for (unsigned n = 0; n < threads_; n++)
+		pool.emplace_back(fn, this);
+	for (auto& t : pool)
+		t.join();
+}
+
+void AluCheck::fill_rows()
+{
+	RefZ80 ref;
+	
+	for (int row; (row = next_row_++) < ROWS; ) {
+		int op = row / 512, first = row % 512 * 256;
+		for (int input = first; input < first + 256; input++)
+			golden_[op * INPUTS + input] = ref_eval(ref, op, input);
+	}
+}
+
+void AluCheck::check_rows()
+{
+	Core core;
+	
+	for (int row; (row = next_row_++) < ROWS; ) {
+		int op = row / 512, first = row % 512 * 256;
+		core_load(core, op);
+		
+		for (int input = first; input < first + 256; input++) {
+			uint16_t expect = golden_[op * INPUTS + input];
+			uint16_t got = core_eval(core, input);
+			if (got == expect || mismatches_[op]++ >= 4)
+				continue;
+			
+			lock_guard<mutex> lock(lock_);
+			cerr << hex << setfill('0') << ALU_NAMES[op] << " a=" << setw(2)
+				<< (input >> 8 & 0xFF) << " b=" << setw(2) << (input & 0xFF)
+				<< " c=" << (input >> 16) << ": core a=" << setw(2) << (got >> 8)
+				<< " f=" << setw(2) << (got & 0xFF) << ", expected a=" << setw(2)
+				<< (expect >> 8) << " f=" << setw(2) << (expect & 0xFF)
+				<< setfill(' ') << dec << endl;
+		}
+	}
+}
+
+void AluCheck::time_ops()
+{
+	Core core;
+	double best[ALU_COUNT];
+	volatile uint64_t sink = 0;
+	
+	for (int op = 0; op < ALU_COUNT; op++) {
+		best[op] = 1e9;
+		core_load(core, op);
+		for (int round = 0; round < rounds_; round++) {
+			auto start = chrono::steady_clock::now();
+			sink = sink + core_sweep(core);
+			chrono::duration<double, nano> took = chrono::steady_clock::now() - start;
+			best[op] = min(best[op], took.count() / INPUTS);
+		}
+	}
+	
+	lock_guard<mutex> lock(lock_);
+	for (int op = 0; op < ALU_COUNT; op++)
+		best_ns_[op] = min(best_ns_[op], best[op]);
+}
+
+bool AluCheck::run()
+{
+	next_row_ = 0;
+	parallel(&AluCheck::fill_rows);
+	
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (uint16_t val : golden_)
+		hash = ((hash ^ (val >> 8)) * 0x100000001B3ull ^ (val & 0xFF)) * 0x100000001B3ull;
+	
+	if (hash != GOLDEN_HASH) {
+		cerr << "golden table hash is " << hex << hash << ", expected "
+			<< GOLDEN_HASH << dec << "; the reference ALU has changed" << endl;
+		return false;
+	}
+	
+	next_row_ = 0;
+	parallel(&AluCheck::check_rows);
+	parallel(&AluCheck::time_ops);
+	
+	bool ok = true;
+	cout << "op    mismatches  ns/op" << endl;
+	for (int op = 0; op < ALU_COUNT; op++) {
+		cout << left << setw(4) << ALU_NAMES[op] << right << setw(12) << mismatches_[op]
+			<< fixed << setprecision(2) << setw(7) << best_ns_[op] << endl;
+		if (mismatches_[op])
+			ok = false;
+	}
+	cout << ALU_COUNT << " x " << INPUTS << " inputs on " << threads_ << " threads, "
+		<< (ok ? "all match" : "MISMATCH") << endl;
+	
+	return ok;
+}
+
+struct ServeOptions {
+	unsigned threads = 0;
+	unsigned pool = 4;
+	string socket;
+	string rom;
+	uint16_t rom_addr = 0;
+	int entry = -1;
+	uint16_t out_addr = 0;
+	uint16_t out_len = 0;
+	uint64_t limit = 10000000;
+	string access_prefix;
+	uint64_t window = 10000;
 };
 
-enum FDOp : uint8_t {
-	FD_LD_A_imm = 0x2E,
-	FD_LD_idx_IY_imm = 0x36,
-	FD_LD_A_ext = 0x3A,
-	FD_INC_idx_IY = 0x34,
-	FD_DEC_idx_IY = 0x35,
-	FD_LD_B_idx_IY = 0x46,
-	FD_LD_C_idx_IY = 0x4E,
-	FD_LD_D_idx_IY = 0x56,
-	FD_LD_E_idx_IY = 0x5E,
-	FD_LD_H_idx_IY = 0x66,
-	FD_LD_idx_IY_B = 0x70,
-	FD_LD_idx_IY_C,
-	FD_LD_idx_IY_D,
-	FD_LD_idx_IY_E,
-	FD_LD_idx_IY_F,
-	FD_LD_idx_IY_L,
-	FD_LD_idx_IY_A = 0x77,
-	FD_LD_A_idx_IX = 0x7E,
-	FD_ADD_A_idx_IY = 0x86,
-	FD_ADC_A_idx_IY = 0x8E,
-	FD_SUB_A_idx_IY = 0x96,
-	FD_SBC_A_idx_IY = 0x9E,
-	FD_AND_A_idx_IY = 0xA6,
-	FD_XOR_A_idx_IY = 0xAE,
-	FD_OR_A_idx_IY = 0xB6,
-	FD_CP_idx_IY = 0xBE,
-	FD_JP_ind_IY = 0xE9
+// Blocking queue of work handed from the reading thread to the workers.
+// pop() returns false once the queue is closed and drained.
+template <typename T>
+class WorkQueue {
+	mutex lock_;
+	condition_variable ready_;
+	deque<T> items_;
+	bool closed_ = false;
+	
+public:
+	void push(T item)
+	{
+		{
+			lock_guard<mutex> hold(lock_);
+			items_.push_back(move(item));
+		}
+		ready_.notify_one();
+	}
+	
+	void close()
+	{
+		{
+			lock_guard<mutex> hold(lock_);
+			closed_ = true;
+		}
+		ready_.notify_all();
+	}
+	
+	bool try_pop(T& item)
+	{
+		lock_guard<mutex> hold(lock_);
+		if (items_.empty())
+			return false;
+		item = move(items_.front());
+		items_.pop_front();
+		return true;
+	}
+	
+	bool pop(T& item)
+	{
+		unique_lock<mutex> hold(lock_);
+		ready_.wait(hold, [this] { return closed_ || !items_.empty(); });
+		if (items_.empty())
+			return false;
+		item = move(items_.front());
+		items_.pop_front();
+		return true;
+	}
 };
 
-class Z80 {
-	const uint8_t FLAG_C = 0x01;
-	const uint8_t FLAG_N = 0x02;
-	const uint8_t FLAG_PV = 0x04;
-	const uint8_t FLAG_H = 0x08;
-	const uint8_t FLAG_Z = 0x40;
-	const uint8_t FLAG_S = 0x80;
-	
-	array<uint8_t, MEM_SIZE> ram_;
-	
-	uint8_t ra_ = 0;
-	uint8_t rb_ = 0;
-	uint8_t rd_ = 0;
-	uint8_t rh_ = 0;
-	uint8_t rf_ = 0;
-	uint8_t rc_ = 0;
-	uint8_t re_ = 0;
-	uint8_t rl_ = 0;
-	uint8_t ra2_ = 0;
-	uint8_t rb2_ = 0;
-	uint8_t rd2_ = 0;
-	uint8_t rh2_ = 0;
-	uint8_t rf2_ = 0;
-	uint8_t rc2_ = 0;
-	uint8_t re2_ = 0;
-	uint8_t rl2_ = 0;
-	uint8_t ri_ = 0;
-	uint8_t rr_ = 0;
-	uint16_t rix_ = 0;
-	uint16_t riy_ = 0;
-	uint16_t rsp_ = 0;
-	uint16_t rpc_ = 0;
-	
-	uint16_t rhl() const { return (uint16_t)rh_ << 8 & rl_; }
-	uint16_t rbc() const { return (uint16_t)rb_ << 8 & rc_; }
-	uint16_t rde() const { return (uint16_t)rd_ << 8 & re_; }
-	
-	bool fc() const { return (rf_ & FLAG_C) > 0; }
-	bool fn() const { return (rf_ & FLAG_N) > 0; }
-	bool fpv() const { return (rf_ & FLAG_PV) > 0; }
-	bool fh() const { return (rf_ & FLAG_H) > 0; }
-	bool fz() const { return (rf_ & FLAG_Z) > 0; }
-	bool fs() const { return (rf_ & FLAG_S) > 0; }
-
-	uint8_t w_calc_flags(uint16_t result, bool is_sub);
-	uint8_t w_logic_flags(uint8_t result);
-	
-	uint8_t op_add(uint8_t a, uint8_t b) { return w_calc_flags(a + b, false); }
-	uint8_t op_adc(uint8_t a, uint8_t b) { return w_calc_flags(a + b + (rf_ & 0x01), false); }
-	uint8_t op_sub(uint8_t a, uint8_t b) { return w_calc_flags(a - b, true); }
-	uint8_t op_sbc(uint8_t a, uint8_t b) { return w_calc_flags(a - b - (rf_ & 0x01), true); }
-	uint8_t op_and(uint8_t a, uint8_t b) { return w_logic_flags(a & b); }
-	uint8_t op_xor(uint8_t a, uint8_t b) { return w_logic_flags(a ^ b); }
-	uint8_t op_or(uint8_t a, uint8_t b) { return w_logic_flags(a | b); }
-	void op_cp(uint8_t a) { w_calc_flags(ra_ - a, true); }
-	uint8_t op_inc(uint8_t a) { return w_calc_flags(a + 1, false); }
-	uint8_t op_dec(uint8_t a) { return w_calc_flags(a - 1, false); }
-	
-	uint8_t next() { return read(rpc_++); }
-	uint16_t next16() { return ((uint16_t)next() << 8) | next(); }
-	uint8_t read(uint16_t addr) const { return ram_[addr]; }
-	void write(uint16_t addr, uint8_t val) { ram_[addr] = val; }
-
-	string pc_str();
-	void dump_regs();
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Runs a fixed routine per request on compact cores that share one ROM
+// image. Each worker has its own arena and a small pool of cores that are
+// set up once and checkpointed; after a request only the pages it wrote
+// are dropped again, so a request costs its own writes rather than a copy
+// of memory.
+//
+// A request is one line of ADDR:HEX memory writes and REG=VALUE register
+// loads, all in hex, for example "8000:0102 hl=8000". The reply is
+// "<n> ok|limit|illegal af=.. bc=.. de=.. hl=.. ix=.. iy=.. sp=.. pc=..
+// cycles=N [out=HEX]" or "<n> error <reason>", where n counts the lines
+// of the stream or connection from 1. One thread reads stdin or polls the
+// connections and queues every line as a job of its own, so that any
+// worker can take it. Replies to a connection are written in the order
+// of its lines, by way of a buffer per connection, so that a client that
+// doesn't read holds up nothing but itself. A core that served a request
+// is rolled back when its worker runs out of jobs, or when the pool comes
+// round to it again.
+//
+// With an access prefix, the cores also count guest memory accesses per
+// page. The counts of all cores are merged and written out at exit, with
+// cycles counted from the start of each request.
+class Server {
+	typedef Z80Base Core;
+	
+	typedef chrono::steady_clock Clock;
+	
+	// A client connection, or stdin and stdout. The reading thread owns
+	// partial and lines, until it sets done at the end of the input.
+	// Replies that are ready before their turn wait in early, and those
+	// answered in unsent until the output takes them, both under the lock.
+	// Sockets are non-blocking, so a client that doesn't read only holds
+	// up its own replies. Stdout, the only client in that mode, blocks.
+	struct Conn {
+		int in;
+		int out;
+		string partial;
+		uint64_t lines = 0;
+		atomic<uint64_t> answered;
+		atomic<bool> broken;
+		atomic<bool> done;
+		
+		mutex lock;
+		map<uint64_t, pair<string, Clock::time_point>> early;
+		string unsent;
+		
+		Conn(int in, int out) : in(in), out(out), answered(0), broken(false), done(false) {}
+		~Conn() { if (in != STDIN_FILENO) ::close(in); }
+	};
+	
+	struct Job {
+		shared_ptr<Conn> conn;
+		uint64_t id;
+		string line;
+		Clock::time_point start;
+	};
+	
+	// lines read ahead of the replies, or bytes of replies not taken by
+	// the client, before a connection stops being read
+	static const uint64_t MAX_PENDING = 1024;
+	static const size_t MAX_UNSENT = 1 << 20;
+	
+	// longest request line, room enough to set all of memory in hex
+	static const size_t MAX_LINE = 256 << 10;
+	
+	const ServeOptions& opts_;
+	RomImage rom_;
+	
+	WorkQueue<Job> jobs_;
+	mutex stats_lock_;
+	vector<uint64_t> latencies_;    // ns
+	unique_ptr<AccessProfiler> access_;
+	int wake_[2] = { -1, -1 };
+	
+	void worker();
+	void handle(Core& core, const string& line, uint64_t id, string& reply);
+	void deliver(Job& job, string& reply, vector<uint64_t>& lat);
+	void flush(Conn& conn);
+	void wake();
+	bool finished(Conn& conn);
+	void read_lines(const shared_ptr<Conn>& conn);
+	void report() const;
+	bool write_access(const string& suffix, void (AccessProfiler::*fn)(ostream&) const) const;
 	
 public:
-	void step();
-	void run_to_nop(bool print = false);
-	
-	array<uint8_t, MEM_SIZE>& ram() { return ram_; }
-	
-	uint8_t reg_a() const { return ra_; }
-	uint8_t reg_b() const { return rb_; }
-	uint8_t reg_d() const { return rd_; }
-	uint8_t reg_h() const { return rh_; }
-	uint8_t reg_f() const { return rf_; }
-	uint8_t reg_c() const { return rc_; }
-	uint8_t reg_e() const { return re_; }
-	uint8_t reg_l() const { return rl_; }
-	uint8_t reg_a2() const { return ra2_; }
-	uint8_t reg_b2() const { return rb2_; }
-	uint8_t reg_d2() const { return rd2_; }
-	uint8_t reg_h2() const { return rh2_; }
-	uint8_t reg_f2() const { return rf2_; }
-	uint8_t reg_c2() const { return rc2_; }
-	uint8_t reg_e2() const { return re2_; }
-	uint8_t reg_l2() const { return rl2_; }
-	uint8_t reg_i() const { return ri_; }
-	uint8_t reg_r() const { return rr_; }
-	uint16_t reg_ix() const { return rix_; }
-	uint16_t reg_iy() const { return riy_; }
-	uint16_t reg_sp() const { return rsp_; }
-	uint16_t reg_pc() const { return rpc_; }
+	Server(const ServeOptions& opts, const vector<uint8_t>& rom);
+	int run();
+	
+	static volatile sig_atomic_t stopping;
 };
 
+volatile sig_atomic_t Server::stopping = 0;
 
-uint8_t Z80::w_calc_flags(uint16_t result, bool is_sub)
-{
-	rf_ = 0;
-	
-	if (result & 0x0100) rf_ |= FLAG_C;
-	if (is_sub) rf_ |= FLAG_N;
-	if (result > 0xFF) rf_ |= FLAG_PV;
-	if (result & 0x08) rf_ |= FLAG_H;
-	if (!result) rf_ |= FLAG_Z;
-	if (result & 0x80) rf_ |= FLAG_S;
-	
-	return (uint8_t)result;
-}
-
-uint8_t Z80::w_logic_flags(uint8_t result)
-{
-	rf_ = 0;
-	
-	uint8_t x = result;
-	x ^= x >> 4;
-	x ^= x >> 2;
-	x ^= x >> 1;
-	bool parity = (~x) & 0x01;
-
-	if (parity) rf_ |= FLAG_PV;
-	if (!result) rf_ |= FLAG_Z;
-	if (result & 0x80) rf_ |= FLAG_S;
-	
-	return result;
-}
-
-string Z80::pc_str()
-{
-	uint8_t old_pc = rpc_;
-	uint8_t code;
-	stringstream str;
-	
-	str << hex << setfill('0');
-	
-	switch (code = next()) {
-		case NOOP: str << "noop"; break;
-		case LD_A_A: str << "ld a, a"; break;
-		case LD_A_B: str << "ld a, b"; break;
-		case LD_A_C: str << "ld a, c"; break;
-		case LD_A_D: str << "ld a, d"; break;
-		case LD_A_E: str << "ld a, e"; break;
-		case LD_A_F: str << "ld a, f"; break;
-		case LD_A_L: str << "ld a, l"; break;
-		case LD_B_A: str << "ld b, a"; break;
-		case LD_B_B: str << "ld b, b"; break;
-		case LD_B_C: str << "ld b, c"; break;
-		case LD_B_D: str << "ld b, d"; break;
-		case LD_B_E: str << "ld b, e"; break;
-		case LD_B_F: str << "ld b, f"; break;
-		case LD_B_L: str << "ld b, l"; break;
-		case LD_C_A: str << "ld c, a"; break;
-		case LD_C_B: str << "ld c, b"; break;
-		case LD_C_C: str << "ld c, c"; break;
-		case LD_C_D: str << "ld c, d"; break;
-		case LD_C_E: str << "ld c, e"; break;
-		case LD_C_F: str << "ld c, f"; break;
-		case LD_C_L: str << "ld c, l"; break;
-		case LD_D_A: str << "ld d, a"; break;
-		case LD_D_B: str << "ld d, b"; break;
-		case LD_D_C: str << "ld d, c"; break;
-		case LD_D_D: str << "ld d, d"; break;
-		case LD_D_E: str << "ld d, e"; break;
-		case LD_D_F: str << "ld d, f"; break;
-		case LD_D_L: str << "ld d, l"; break;
-		case LD_E_A: str << "ld e, a"; break;
-		case LD_E_B: str << "ld e, b"; break;
-		case LD_E_C: str << "ld e, c"; break;
-		case LD_E_D: str << "ld e, d"; break;
-		case LD_E_E: str << "ld e, e"; break;
-		case LD_E_F: str << "ld e, f"; break;
-		case LD_E_L: str << "ld e, l"; break;
-		case LD_H_A: str << "ld h, a"; break;
-		case LD_H_B: str << "ld h, b"; break;
-		case LD_H_C: str << "ld h, c"; break;
-		case LD_H_D: str << "ld h, d"; break;
-		case LD_H_E: str << "ld h, e"; break;
-		case LD_H_F: str << "ld h, f"; break;
-		case LD_H_L: str << "ld h, l"; break;
-		case LD_L_A: str << "ld l, a"; break;
-		case LD_L_B: str << "ld l, b"; break;
-		case LD_L_C: str << "ld l, c"; break;
-		case LD_L_D: str << "ld l, d"; break;
-		case LD_L_E: str << "ld l, e"; break;
-		case LD_L_F: str << "ld l, f"; break;
-		case LD_L_L: str << "ld l, l"; break;
-		case LD_A_ind_HL: str << "ld a, (hl)"; break;
-		case LD_A_ind_BC: str << "ld a, (bc)"; break;
-		case LD_A_ind_DE: str << "ld a, (de)"; break;
-		case LD_B_ind_HL: str << "ld b, (hl)"; break;
-		case LD_C_ind_HL: str << "ld c, (hl)"; break;
-		case LD_D_ind_HL: str << "ld d, (hl)"; break;
-		case LD_E_ind_HL: str << "ld e, (hl)"; break;
-		case LD_H_ind_HL: str << "ld h, (hl)"; break;
-		case LD_L_ind_HL: str << "ld l, (hl)"; break;
-		case LD_ind_HL_A: str << "ld (hl), a"; break;
-		case LD_ind_HL_B: str << "ld (hl), b"; break;
-		case LD_ind_HL_C: str << "ld (hl), c"; break;
-		case LD_ind_HL_D: str << "ld (hl), d"; break;
-		case LD_ind_HL_E: str << "ld (hl), e"; break;
-		case LD_ind_HL_F: str << "ld (hl), f"; break;
-		case LD_ind_HL_L: str << "ld (hl), l"; break;
-		case LD_ind_BC_A: str << "ld (bc), a"; break;
-		case LD_ind_DE_A: str << "ld (de), a"; break;
-		case LD_ext_A: str << "ld (0x" << setw(4) << next16() << "), a"; break;
-		case ADD_A_A: str << "add a, a"; break;
-		case ADD_A_B: str << "add a, b"; break;
-		case ADD_A_C: str << "add a, c"; break;
-		case ADD_A_D: str << "add a, d"; break;
-		case ADD_A_E: str << "add a, e"; break;
-		case ADD_A_F: str << "add a, f"; break;
-		case ADD_A_L: str << "add a, l"; break;
-		case ADD_A_ind_HL: str << "add a, (hl)"; break;
-		case ADD_A_imm: str << "add a, 0x" << setw(2) << (int)next(); break;
-		case ADC_A_A: str << "adc a, a"; break;
-		case ADC_A_B: str << "adc a, b"; break;
-		case ADC_A_C: str << "adc a, c"; break;
-		case ADC_A_D: str << "adc a, d"; break;
-		case ADC_A_E: str << "adc a, e"; break;
-		case ADC_A_F: str << "adc a, f"; break;
-		case ADC_A_L: str << "adc a, l"; break;
-		case ADC_A_ind_HL: str << "adc a, (hl)"; break;
-		case ADC_A_imm: str << "adc a, 0x" << setw(2) << (int)next(); break;
-		case SUB_A_A: str << "sub a, a"; break;
-		case SUB_A_B: str << "sub a, b"; break;
-		case SUB_A_C: str << "sub a, c"; break;
-		case SUB_A_D: str << "sub a, d"; break;
-		case SUB_A_E: str << "sub a, e"; break;
-		case SUB_A_F: str << "sub a, f"; break;
-		case SUB_A_L: str << "sub a, l"; break;
-		case SUB_A_ind_HL: str << "sub a, (hl)"; break;
-		case SUB_A_imm: str << "sub a, 0x" << setw(2) << (int)next(); break;
-		case SBC_A_A: str << "sbc a, a"; break;
-		case SBC_A_B: str << "sbc a, b"; break;
-		case SBC_A_C: str << "sbc a, c"; break;
-		case SBC_A_D: str << "sbc a, d"; break;
-		case SBC_A_E: str << "sbc a, e"; break;
-		case SBC_A_F: str << "sbc a, f"; break;
-		case SBC_A_L: str << "sbc a, l"; break;
-		case SBC_A_ind_HL: str << "sbc a, (hl)"; break;
-		case SBC_A_imm: str << "sbc a, 0x" << setw(2) << (int)next(); break;
-		case AND_A_A: str << "and a, a"; break;
-		case AND_A_B: str << "and a, b"; break;
-		case AND_A_C: str << "and a, c"; break;
-		case AND_A_D: str << "and a, d"; break;
-		case AND_A_E: str << "and a, e"; break;
-		case AND_A_F: str << "and a, f"; break;
-		case AND_A_L: str << "and a, l"; break;
-		case AND_A_ind_HL: str << "and a, (hl)"; break;
-		case AND_A_imm: str << "and a, 0x" << setw(2) << (int)next(); break;
-		case XOR_A_A: str << "xor a, a"; break;
-		case XOR_A_B: str << "xor a, b"; break;
-		case XOR_A_C: str << "xor a, c"; break;
-		case XOR_A_D: str << "xor a, d"; break;
-		case XOR_A_E: str << "xor a, e"; break;
-		case XOR_A_F: str << "xor a, f"; break;
-		case XOR_A_L: str << "xor a, l"; break;
-		case XOR_A_ind_HL: str << "xor a, (hl)"; break;
-		case XOR_A_imm: str << "xor a, 0x" << setw(2) << (int)next(); break;
-		case OR_A_A: str << "or a, a"; break;
-		case OR_A_B: str << "or a, b"; break;
-		case OR_A_C: str << "or a, c"; break;
-		case OR_A_D: str << "or a, d"; break;
-		case OR_A_E: str << "or a, e"; break;
-		case OR_A_F: str << "or a, f"; break;
-		case OR_A_L: str << "or a, l"; break;
-		case OR_A_ind_HL: str << "or a, (hl)"; break;
-		case OR_A_imm: str << "or a, 0x" << setw(2) << (int)next(); break;
-		case CP_A: str << "cp a"; break;
-		case CP_B: str << "cp b"; break;
-		case CP_C: str << "cp c"; break;
-		case CP_D: str << "cp d"; break;
-		case CP_E: str << "cp e"; break;
-		case CP_F: str << "cp f"; break;
-		case CP_L: str << "cp l"; break;
-		case CP_ind_HL: str << "cp (hl)"; break;
-		case CP_imm: str << "cp 0x" << setw(2) << (int)next(); break;
-		case INC_A: str << "inc a"; break;
-		case INC_B: str << "inc b"; break;
-		case INC_C: str << "inc c"; break;
-		case INC_D: str << "inc d"; break;
-		case INC_E: str << "inc e"; break;
-		case INC_F: str << "inc f"; break;
-		case INC_L: str << "inc l"; break;
-		case INC_ind_HL: str << "inc (hl)"; break;
-		case DEC_A: str << "dec a"; break;
-		case DEC_B: str << "dec b"; break;
-		case DEC_C: str << "dec c"; break;
-		case DEC_D: str << "dec d"; break;
-		case DEC_E: str << "dec e"; break;
-		case DEC_F: str << "dec f"; break;
-		case DEC_L: str << "dec l"; break;
-		case DEC_ind_HL: str << "dec (hl)"; break;
-		case JP: str << "jp 0x" << setw(4) << next16(); break;
-		case JP_C: str << "jp c, 0x" << setw(4) << next16(); break;
-		case JP_NC: str << "jp nc, 0x" << setw(4) << next16(); break;
-		case JP_Z: str << "jp z, 0x" << setw(4) << next16(); break;
-		case JP_NZ: str << "jp nz, 0x" << setw(4) << next16(); break;
-		case JP_PO: str << "jp po, 0x" << setw(4) << next16(); break;
-		case JP_PE: str << "jp pe, 0x" << setw(4) << next16(); break;
-		case JP_M: str << "jp m, 0x" << setw(4) << next16(); break;
-		case JP_P: str << "jp p, 0x" << setw(4) << next16(); break;
-		case JP_ind_HL: str << "jp (hl)"; break;
-		case JR: str << "jr 0x" << setw(2) << (int)next(); break;
-		case JR_C: str << "jr c, 0x" << setw(2) << (int)next(); break;
-		case JR_NC: str << "jr nc, 0x" << setw(2) << (int)next(); break;
-		case JR_Z: str << "jr z, 0x" << setw(2) << (int)next(); break;
-		case JR_NZ: str << "jr nz, 0x" << setw(2) << (int)next(); break;
-		case DJNZ: str << "djnz 0x" << setw(2) << (int)next(); break;
-			
-		case EXT_DD:
-			switch (code = next()) {
-				case DD_LD_B_imm: str << "ld b, 0x" << setw(2) << (int)next(); break;
-				case DD_LD_C_imm: str << "ld c, 0x" << setw(2) << (int)next(); break;
-				case DD_LD_D_imm: str << "ld d, 0x" << setw(2) << (int)next(); break;
-				case DD_LD_E_imm: str << "ld e, 0x" << setw(2) << (int)next(); break;
-				case DD_LD_H_imm: str << "ld h, 0x" << setw(2) << (int)next(); break;
-				case DD_LD_A_idx_IY: str << "ld a, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_LD_B_idx_IX: str << "ld b, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_LD_C_idx_IX: str << "ld c, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_LD_D_idx_IX: str << "ld d, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_LD_E_idx_IX: str << "ld e, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_LD_H_idx_IX: str << "ld h, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_LD_L_idx_IX: str << "ld l, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_LD_idx_IX_A: str << "ld (ix + 0x" << setw(2) << (int)next() << "), a"; break;
-				case DD_LD_idx_IX_B: str << "ld (ix + 0x" << setw(2) << (int)next() << "), b"; break;
-				case DD_LD_idx_IX_C: str << "ld (ix + 0x" << setw(2) << (int)next() << "), c"; break;
-				case DD_LD_idx_IX_D: str << "ld (ix + 0x" << setw(2) << (int)next() << "), d"; break;
-				case DD_LD_idx_IX_E: str << "ld (ix + 0x" << setw(2) << (int)next() << "), e"; break;
-				case DD_LD_idx_IX_F: str << "ld (ix + 0x" << setw(2) << (int)next() << "), f"; break;
-				case DD_LD_idx_IX_L: str << "ld (ix + 0x" << setw(2) << (int)next() << "), l"; break;
-				case DD_LD_idx_IX_imm: str << "ld (ix + 0x" << setw(2) << (int)next() << "), 0x" << setw(2) << (int)next(); break;
-				case DD_LD_ind_HL_imm: str << "ld (hl), 0x" << setw(2) << (int)next(); break;
-				case DD_ADD_A_idx_IX: str << "add a, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_ADC_A_idx_IX: str << "adc a, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_SUB_A_idx_IX: str << "sub a, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_SBC_A_idx_IX: str << "sbc a, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_AND_A_idx_IX: str << "and a, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_XOR_A_idx_IX: str << "xor a, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_OR_A_idx_IX: str << "or a, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_CP_idx_IX: str << "cp (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case DD_JP_ind_IX: str << "jp (ix)"; break;
-				default: str << "0x" << (0xDD00 & code); break;
+static void on_stop_signal(int)
+{
+	Server::stopping = 1;
+}
+
+Server::Server(const ServeOptions& opts, const vector<uint8_t>& rom)
+	: opts_(opts), rom_(rom.data(), rom.size())
+{
+	if (!opts.access_prefix.empty())
+		access_.reset(new AccessProfiler(0, opts.window));
+}
+
+void Server::handle(Core& core, const string& line, uint64_t id, string& reply)
+{
+	static const struct { const char *name; uint16_t Registers::*reg; } REGS[] = {
+		{ "af", &Registers::af }, { "bc", &Registers::bc }, { "de", &Registers::de },
+		{ "hl", &Registers::hl }, { "ix", &Registers::ix }, { "iy", &Registers::iy },
+		{ "sp", &Registers::sp }
+	};
+	
+	char buf[160];
+	const char *p = line.c_str();
+	
+	while (*p) {
+		if (*p == ' ' || *p == '\t' || *p == '\r') {
+			p++;
+			continue;
+		}
+		
+		const char *sep = p;
+		while (*sep && *sep != ':' && *sep != '=' && *sep != ' ')
+			sep++;
+		
+		char *end;
+		unsigned long addr = strtoul(p, &end, 16);
+		if (*sep == ':' && end == sep && addr < MEM_SIZE) {
+			// ADDR:HEX
+			for (p = sep + 1; hex_digit(p[0]) >= 0; p += 2, addr++) {
+				if (hex_digit(p[1]) < 0 || addr >= MEM_SIZE) {
+					snprintf(buf, sizeof buf, "%llu error bad data\n", (unsigned long long)id);
+					reply = buf;
+					return;
+				}
+				core.poke((uint16_t)addr, (uint8_t)(hex_digit(p[0]) << 4 | hex_digit(p[1])));
 			}
-			break;
-			
-		case EXT_ED:
-			switch (next()) {
-				case ED_LD_imp_I_A: str << "ld i, a"; break;
-				case ED_LD_imp_R_A: str << "ld r, a"; break;
-				default: str << "0x" << (0xED00 & code); break;
+			continue;
+		}
+		
+		bool found = false;
+		if (*sep == '=') {
+			unsigned long val = strtoul(sep + 1, &end, 16);
+			for (const auto& r : REGS) {
+				if (sep - p == 2 && !strncmp(p, r.name, 2) && end > sep + 1 && val <= 0xFFFF) {
+					core.regs().*r.reg = (uint16_t)val;
+					found = true;
+				}
 			}
+			p = end;
+		}
+		
+		if (!found) {
+			snprintf(buf, sizeof buf, "%llu error bad argument\n", (unsigned long long)id);
+			reply = buf;
+			return;
+		}
+	}
+	
+	Stop stop = core.run_to_nop(nullptr, opts_.limit);
+	const char *status = stop == STOP_LIMIT ? "limit" : stop == STOP_ILLEGAL ? "illegal" : "ok";
+	
+	const Registers& r = core.regs();
+	snprintf(buf, sizeof buf, "%llu %s af=%04x bc=%04x de=%04x hl=%04x ix=%04x iy=%04x "
+		"sp=%04x pc=%04x cycles=%llu", (unsigned long long)id, status, r.af, r.bc,
+		r.de, r.hl, r.ix, r.iy, r.sp, r.pc, (unsigned long long)core.cycles());
+	reply = buf;
+	
+	if (opts_.out_len) {
+		static const char DIGITS[] = "0123456789abcdef";
+		reply += " out=";
+		for (uint32_t addr = opts_.out_addr; addr < (uint32_t)opts_.out_addr + opts_.out_len; addr++) {
+			uint8_t val = core.peek((uint16_t)addr);
+			reply += DIGITS[val >> 4];
+			reply += DIGITS[val & 15];
+		}
+	}
+	
+	reply += '\n';
+}
+
+// Queues the reply to a job, and those held back for it, as soon as every
+// earlier line of the connection has been answered, and writes as much as
+// the connection takes. The reading thread is woken when output is left
+// over where there was none, and for the last reply.
+void Server::deliver(Job& job, string& reply, vector<uint64_t>& lat)
+{
+	Conn& conn = *job.conn;
+	lock_guard<mutex> hold(conn.lock);
+	
+	if (job.id != conn.answered + 1) {
+		conn.early[job.id] = make_pair(move(reply), job.start);
+		return;
+	}
+	
+	string *text = &reply;
+	Clock::time_point start = job.start;
+	bool was_empty = conn.unsent.empty();
+	for (;;) {
+		if (!conn.broken)
+			conn.unsent += *text;
+		lat.push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+		conn.answered++;
+		
+		if (text != &reply)
+			conn.early.erase(conn.early.begin());
+		if (conn.early.empty() || conn.early.begin()->first != conn.answered + 1)
 			break;
-			
-		case EXT_FD:
-			switch (code = next()) {
-				case FD_LD_A_imm: str << "ld a, 0x" << setw(2) << (int)next(); break;
-				case FD_LD_A_ext: str << "ld a, (0x" << setw(4) << next16() << ")"; break;
-				case FD_LD_A_idx_IX: str << "ld a, (ix + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_LD_B_idx_IY: str << "ld b, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_LD_C_idx_IY: str << "ld c, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_LD_D_idx_IY: str << "ld d, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_LD_E_idx_IY: str << "ld e, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_LD_H_idx_IY: str << "ld h, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_LD_idx_IY_A: str << "ld (iy + 0x" << setw(2) << (int)next() << "), a"; break;
-				case FD_LD_idx_IY_B: str << "ld (iy + 0x" << setw(2) << (int)next() << "), b"; break;
-				case FD_LD_idx_IY_C: str << "ld (iy + 0x" << setw(2) << (int)next() << "), c"; break;
-				case FD_LD_idx_IY_D: str << "ld (iy + 0x" << setw(2) << (int)next() << "), d"; break;
-				case FD_LD_idx_IY_E: str << "ld (iy + 0x" << setw(2) << (int)next() << "), e"; break;
-				case FD_LD_idx_IY_F: str << "ld (iy + 0x" << setw(2) << (int)next() << "), f"; break;
-				case FD_LD_idx_IY_L: str << "ld (iy + 0x" << setw(2) << (int)next() << "), l"; break;
-				case FD_LD_idx_IY_imm: str << "ld (iy + 0x" << setw(2) << (int)next() << "), 0x" << setw(2) << (int)next(); break;
-				case FD_ADD_A_idx_IY: str << "add a, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_ADC_A_idx_IY: str << "adc a, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_SUB_A_idx_IY: str << "sub a, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_SBC_A_idx_IY: str << "sbc a, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_AND_A_idx_IY: str << "and a, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_XOR_A_idx_IY: str << "xor a, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_OR_A_idx_IY: str << "or a, (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_CP_idx_IY: str << "cp (iy + 0x" << setw(2) << (int)next() << ")"; break;
-				case FD_JP_ind_IY: str << "jp (iy)"; break;
-				default: str << "0x" << (0xFD00 & code); break;
-			}
+		text = &conn.early.begin()->second.first;
+		start = conn.early.begin()->second.second;
+	}
+	
+	flush(conn);
+	if ((was_empty && !conn.unsent.empty()) || (conn.done && conn.answered == conn.lines))
+		wake();
+}
+
+// Writes a connection's unsent replies, as far as a socket takes them
+// without blocking. Called with the connection locked.
+void Server::flush(Conn& conn)
+{
+	size_t sent = 0;
+	
+	while (sent < conn.unsent.size() && !conn.broken) {
+		ssize_t put = ::write(conn.out, conn.unsent.data() + sent, conn.unsent.size() - sent);
+		if (put < 0 && errno == EINTR)
+			continue;
+		if (put < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
 			break;
-			
-		default:
-			str << "0x" << (int)code;;
+		if (put <= 0)
+			conn.broken = true;
+		else
+			sent += (size_t)put;
+	}
+	
+	if (conn.broken)
+		conn.unsent.clear();
+	else
+		conn.unsent.erase(0, sent);
+}
+
+void Server::wake()
+{
+	char byte = 0;
+	if (::write(wake_[1], &byte, 1) < 0 && errno != EAGAIN)
+		cerr << "serve: wake: " << strerror(errno) << endl;
+}
+
+// Whether a connection can be let go: broken, or read to the end with
+// every reply answered and written.
+bool Server::finished(Conn& conn)
+{
+	if (conn.broken)
+		return true;
+	if (!conn.done || conn.answered != conn.lines)
+		return false;
+	
+	lock_guard<mutex> hold(conn.lock);
+	return conn.unsent.empty();
+}
+
+void Server::worker()
+{
+	PageArena arena;
+	vector<unique_ptr<Core>> cores;
+	vector<bool> dirty(opts_.pool);
+	vector<uint64_t> lat;
+	size_t next = 0;
+	
+	for (unsigned n = 0; n < opts_.pool; n++) {
+		cores.push_back(make_z80(FEATURE_COMPACT | FEATURE_CYCLES | (access_ ? (unsigned)FEATURE_PROFILE : 0u), &arena));
+		Core& core = *cores.back();
+		if (access_)
+			core.enable_access_profiler(opts_.window);
+		core.map_rom(opts_.rom_addr, rom_);
+		core.regs().pc = (uint16_t)(opts_.entry >= 0 ? opts_.entry : opts_.rom_addr);
+		core.checkpoint();
+	}
+	
+	Job job;
+	string reply;
+	for (;;) {
+		if (!jobs_.try_pop(job)) {
+			for (unsigned n = 0; n < opts_.pool; n++)
+				if (dirty[n])
+					cores[n]->rollback();
+			dirty.assign(opts_.pool, false);
+			if (!jobs_.pop(job))
+				break;
+		}
+		
+		size_t n = next;
+		next = (next + 1) % opts_.pool;
+		if (dirty[n])
+			cores[n]->rollback();
+		
+		handle(*cores[n], job.line, job.id, reply);
+		dirty[n] = true;
+		deliver(job, reply, lat);
+		job.conn.reset();
+	}
+	
+	lock_guard<mutex> hold(stats_lock_);
+	latencies_.insert(latencies_.end(), lat.begin(), lat.end());
+	if (access_)
+		for (auto& core : cores)
+			access_->merge(*core->access_profiler());
+}
+
+// Queues the complete lines that can be read from a connection without
+// blocking. Sets done at its end. A line longer than MAX_LINE breaks the
+// connection.
+void Server::read_lines(const shared_ptr<Conn>& conn)
+{
+	char buf[4096];
+	ssize_t got = ::read(conn->in, buf, sizeof buf);
+	if (got < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	
+	if (got <= 0) {
+		if (!conn->partial.empty())
+			jobs_.push(Job { conn, ++conn->lines, move(conn->partial), Clock::now() });
+		conn->done = true;
+		return;
+	}
+	
+	Clock::time_point now = Clock::now();
+	const char *p = buf, *end = buf + got;
+	while (p < end) {
+		const char *nl = (const char *)memchr(p, '\n', end - p);
+		const char *stop = nl ? nl : end;
+		if (conn->partial.size() + (stop - p) > MAX_LINE) {
+			cerr << "serve: line " << conn->lines + 1 << " is longer than " << MAX_LINE
+				<< " bytes, closing the connection" << endl;
+			conn->partial.clear();
+			conn->broken = true;
+			conn->done = true;
+			return;
+		}
+		
+		conn->partial.append(p, stop);
+		if (!nl)
 			break;
+		jobs_.push(Job { conn, ++conn->lines, move(conn->partial), now });
+		conn->partial.clear();
+		p = nl + 1;
+	}
+}
+
+void Server::report() const
+{
+	vector<uint64_t> lat = latencies_;
+	sort(lat.begin(), lat.end());
+	
+	cerr << lat.size() << " requests";
+	if (!lat.empty()) {
+		auto at = [&](double q) { return lat[(size_t)(q * (lat.size() - 1))] / 1000.0; };
+		cerr << fixed << setprecision(1) << ", latency us: p50 " << at(0.5) << "  p90 "
+			<< at(0.9) << "  p99 " << at(0.99) << "  p99.9 " << at(0.999) << "  max "
+			<< lat.back() / 1000.0;
+	}
+	cerr << endl;
+	
+	if (access_) {
+		write_access(".heat.csv", &AccessProfiler::write_csv);
+		write_access(".ws.csv", &AccessProfiler::write_working_set_csv);
+		write_access(".json", &AccessProfiler::write_json);
+	}
+}
+
+bool Server::write_access(const string& suffix, void (AccessProfiler::*fn)(ostream&) const) const
+{
+	string path = opts_.access_prefix + suffix;
+	ofstream out(path);
+	(access_.get()->*fn)(out);
+	
+	if (!out.flush()) {
+		cerr << "serve: can't write " << path << endl;
+		return false;
+	}
+	return true;
+}
+
+int Server::run()
+{
+	unsigned threads = opts_.threads ? opts_.threads : thread::hardware_concurrency();
+	if (!threads)
+		threads = 1;
+	
+	int listen_fd = -1;
+	if (!opts_.socket.empty()) {
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (opts_.socket.size() >= sizeof addr.sun_path) {
+			cerr << "serve: socket path too long" << endl;
+			return 1;
+		}
+		strcpy(addr.sun_path, opts_.socket.c_str());
+		::unlink(addr.sun_path);
+		
+		listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listen_fd < 0 || ::bind(listen_fd, (sockaddr *)&addr, sizeof addr) < 0 ||
+			::listen(listen_fd, 64) < 0) {
+			cerr << "serve: " << opts_.socket << ": " << strerror(errno) << endl;
+			return 1;
+		}
+	}
+	
+	// only this thread takes SIGINT and SIGTERM, which interrupt poll()
+	sigset_t stop_sigs, old_sigs;
+	sigemptyset(&stop_sigs);
+	sigaddset(&stop_sigs, SIGINT);
+	sigaddset(&stop_sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_sigs, &old_sigs);
+	
+	if (::pipe(wake_) < 0 || ::fcntl(wake_[0], F_SETFL, O_NONBLOCK) < 0 ||
+		::fcntl(wake_[1], F_SETFL, O_NONBLOCK) < 0) {
+		cerr << "serve: pipe: " << strerror(errno) << endl;
+		return 1;
 	}
 	
-	rpc_ = old_pc;
-	return str.str();
-}
-
-void Z80::dump_regs()
-{
-	stringstream str;
-
-	str << hex << setfill('0')
-		<<   "A: 0x"  << setw(2) << (int)ra_  << "  F: 0x"  << setw(2) << (int)rf_
-		<< "  A': 0x" << setw(2) << (int)ra2_ << "  F': 0x" << setw(2) << (int)rf2_ << endl
-		<<   "B: 0x"  << setw(2) << (int)rb_  << "  C: 0x"  << setw(2) << (int)rc_
-		<< "  B': 0x" << setw(2) << (int)rb2_ << "  C': 0x" << setw(2) << (int)rc2_ << endl
-		<<   "D: 0x"  << setw(2) << (int)rd_  << "  E: 0x"  << setw(2) << (int)re_
-		<< "  D': 0x" << setw(2) << (int)rd2_ << "  E': 0x" << setw(2) << (int)re2_ << endl
-		<<   "H: 0x"  << setw(2) << (int)rh_  << "  L: 0x"  << setw(2) << (int)rl_
-		<< "  H': 0x" << setw(2) << (int)rh2_ << "  L': 0x" << setw(2) << (int)rl2_ << endl
-		<< "I: 0x"  << setw(2) << (int)ri_  << "  R: 0x"  << setw(2) << (int)rr_ << endl
-		<< "IX: 0x"  << setw(4) << rix_ << endl
-		<< "IY: 0x"  << setw(4) << riy_ << endl
-		<< "SP: 0x"  << setw(4) << rsp_ << endl
-		<< "PC: 0x"  << setw(4) << rpc_ << endl
-		<<    "S: " << fs()  << "  Z: " << fz() << "  H: " << fh()
-		<< "  PV: " << fpv() << "  N: " << fn() << "  C: " << fc() << endl;
-
-	cout << str.str();
-}
-
-void Z80::step()
-{
-	uint8_t tmp;
-	uint16_t tmp16;
-
-	uint8_t code;
-	switch (code = next()) {
-		case LD_A_A: break;
-		case LD_A_B: ra_ = rb_; break;;
-		case LD_A_C: ra_ = rc_; break;
-		case LD_A_D: ra_ = rd_; break;
-		case LD_A_E: ra_ = re_; break;
-		case LD_A_F: ra_ = rf_; break;
-		case LD_A_L: ra_ = rl_; break;
-		case LD_B_A: rb_ = ra_; break;
-		case LD_B_B: break;
-		case LD_B_C: rb_ = rc_; break;
-		case LD_B_D: rb_ = rd_; break;
-		case LD_B_E: rb_ = re_; break;
-		case LD_B_F: rb_ = rf_; break;
-		case LD_B_L: rb_ = rl_; break;
-		case LD_C_A: rc_ = ra_; break;
-		case LD_C_B: rc_ = rb_; break;
-		case LD_C_C: break;
-		case LD_C_D: rc_ = rd_; break;
-		case LD_C_E: rc_ = re_; break;
-		case LD_C_F: rc_ = rf_; break;
-		case LD_C_L: rc_ = rl_; break;
-		case LD_D_A: rd_ = ra_; break;
-		case LD_D_B: rd_ = rb_; break;
-		case LD_D_C: rd_ = rc_; break;
-		case LD_D_D: break;
-		case LD_D_E: rd_ = re_; break;
-		case LD_D_F: rd_ = rf_; break;
-		case LD_D_L: rd_ = rl_; break;
-		case LD_E_A: re_ = ra_; break;
-		case LD_E_B: re_ = rb_; break;
-		case LD_E_C: re_ = rc_; break;
-		case LD_E_D: re_ = rd_; break;
-		case LD_E_E: break;
-		case LD_E_F: re_ = rf_; break;
-		case LD_E_L: re_ = rl_; break;
-		case LD_H_A: rh_ = ra_; break;
-		case LD_H_B: rh_ = rb_; break;
-		case LD_H_C: rh_ = rc_; break;
-		case LD_H_D: rh_ = rd_; break;
-		case LD_H_E: rh_ = re_; break;
-		case LD_H_F: rh_ = rf_; break;
-		case LD_H_L: rf_ = rl_; break;
-		case LD_L_A: rl_ = ra_; break;
-		case LD_L_B: rl_ = rb_; break;
-		case LD_L_C: rl_ = rc_; break;
-		case LD_L_D: rl_ = rd_; break;
-		case LD_L_E: rl_ = re_; break;
-		case LD_L_F: rl_ = rf_; break;
-		case LD_L_L: break;
-		case LD_A_ind_HL: ra_ = read(rhl()); break;
-		case LD_A_ind_BC: ra_ = read(rbc()); break;
-		case LD_A_ind_DE: ra_ = read(rde()); break;
-		case LD_B_ind_HL: rb_ = read(rhl()); break;
-		case LD_C_ind_HL: rc_ = read(rhl()); break;
-		case LD_D_ind_HL: rd_ = read(rhl()); break;
-		case LD_E_ind_HL: re_ = read(rhl()); break;
-		case LD_H_ind_HL: rh_ = read(rhl()); break;
-		case LD_L_ind_HL: rl_ = read(rhl()); break;
-		case LD_ind_HL_A: write(rhl(), ra_); break;
-		case LD_ind_HL_B: write(rhl(), rb_); break;
-		case LD_ind_HL_C: write(rhl(), rc_); break;
-		case LD_ind_HL_D: write(rhl(), rd_); break;
-		case LD_ind_HL_E: write(rhl(), re_); break;
-		case LD_ind_HL_F: write(rhl(), rf_); break;
-		case LD_ind_HL_L: write(rhl(), rl_); break;
-		case LD_ind_BC_A: write(rbc(), ra_); break;
-		case LD_ind_DE_A: write(rde(), ra_); break;
-		case LD_ext_A: write(next16(), ra_); break;
-		case ADD_A_A: ra_ = op_add(ra_, ra_); break;
-		case ADD_A_B: ra_ = op_add(ra_, rb_); break;
-		case ADD_A_C: ra_ = op_add(ra_, rc_); break;
-		case ADD_A_D: ra_ = op_add(ra_, rd_); break;
-		case ADD_A_E: ra_ = op_add(ra_, re_); break;
-		case ADD_A_F: ra_ = op_add(ra_, rf_); break;
-		case ADD_A_L: ra_ = op_add(ra_, rl_); break;
-		case ADD_A_ind_HL: ra_ = op_add(ra_, read(rhl())); break;
-		case ADD_A_imm: ra_ = op_add(ra_, next()); break;
-		case ADC_A_A: ra_ = op_adc(ra_, ra_); break;
-		case ADC_A_B: ra_ = op_adc(ra_, rb_); break;
-		case ADC_A_C: ra_ = op_adc(ra_, rc_); break;
-		case ADC_A_D: ra_ = op_adc(ra_, rd_); break;
-		case ADC_A_E: ra_ = op_adc(ra_, re_); break;
-		case ADC_A_F: ra_ = op_adc(ra_, rf_); break;
-		case ADC_A_L: ra_ = op_adc(ra_, rl_); break;
-		case ADC_A_ind_HL: ra_ = op_adc(ra_, read(rhl())); break;
-		case ADC_A_imm: ra_ = op_adc(ra_, next()); break;
-		case SUB_A_A: ra_ = op_sub(ra_, ra_); break;
-		case SUB_A_B: ra_ = op_sub(ra_, rb_); break;
-		case SUB_A_C: ra_ = op_sub(ra_, rc_); break;
-		case SUB_A_D: ra_ = op_sub(ra_, rd_); break;
-		case SUB_A_E: ra_ = op_sub(ra_, re_); break;
-		case SUB_A_F: ra_ = op_sub(ra_, rf_); break;
-		case SUB_A_L: ra_ = op_sub(ra_, rl_); break;
-		case SUB_A_ind_HL: ra_ = op_sub(ra_, read(rhl())); break;
-		case SUB_A_imm: ra_ = op_sub(ra_, next()); break;
-		case SBC_A_A: ra_ = op_sbc(ra_, ra_); break;
-		case SBC_A_B: ra_ = op_sbc(ra_, rb_); break;
-		case SBC_A_C: ra_ = op_sbc(ra_, rc_); break;
-		case SBC_A_D: ra_ = op_sbc(ra_, rd_); break;
-		case SBC_A_E: ra_ = op_sbc(ra_, re_); break;
-		case SBC_A_F: ra_ = op_sbc(ra_, rf_); break;
-		case SBC_A_L: ra_ = op_sbc(ra_, rl_); break;
-		case SBC_A_ind_HL: ra_ = op_sbc(ra_, read(rhl())); break;
-		case SBC_A_imm: ra_ = op_sbc(ra_, next()); break;
-		case AND_A_A: ra_ = op_and(ra_, ra_); break;
-		case AND_A_B: ra_ = op_and(ra_, rb_); break;
-		case AND_A_C: ra_ = op_and(ra_, rc_); break;
-		case AND_A_D: ra_ = op_and(ra_, rd_); break;
-		case AND_A_E: ra_ = op_and(ra_, re_); break;
-		case AND_A_F: ra_ = op_and(ra_, rf_); break;
-		case AND_A_L: ra_ = op_and(ra_, rl_); break;
-		case AND_A_ind_HL: ra_ = op_and(ra_, read(rhl())); break;
-		case AND_A_imm: ra_ = op_and(ra_, next()); break;
-		case XOR_A_A: ra_ = op_xor(ra_, ra_); break;
-		case XOR_A_B: ra_ = op_xor(ra_, rb_); break;
-		case XOR_A_C: ra_ = op_xor(ra_, rc_); break;
-		case XOR_A_D: ra_ = op_xor(ra_, rd_); break;
-		case XOR_A_E: ra_ = op_xor(ra_, re_); break;
-		case XOR_A_F: ra_ = op_xor(ra_, rf_); break;
-		case XOR_A_L: ra_ = op_xor(ra_, rl_); break;
-		case XOR_A_ind_HL: ra_ = op_xor(ra_, read(rhl())); break;
-		case XOR_A_imm: ra_ = op_xor(ra_, next()); break;
-		case OR_A_A: ra_ = op_or(ra_, ra_); break;
-		case OR_A_B: ra_ = op_or(ra_, rb_); break;
-		case OR_A_C: ra_ = op_or(ra_, rc_); break;
-		case OR_A_D: ra_ = op_or(ra_, rd_); break;
-		case OR_A_E: ra_ = op_or(ra_, re_); break;
-		case OR_A_F: ra_ = op_or(ra_, rf_); break;
-		case OR_A_L: ra_ = op_or(ra_, rl_); break;
-		case OR_A_ind_HL: ra_ = op_or(ra_, read(rhl())); break;
-		case OR_A_imm: ra_ = op_or(ra_, next()); break;
-		case CP_A: op_cp(ra_); break;
-		case CP_B: op_cp(rb_); break;
-		case CP_C: op_cp(rc_); break;
-		case CP_D: op_cp(rd_); break;
-		case CP_E: op_cp(re_); break;
-		case CP_F: op_cp(rf_); break;
-		case CP_L: op_cp(rl_); break;
-		case CP_ind_HL: op_cp(read(rhl())); break;
-		case CP_imm: op_cp(next()); break;
-		case INC_A: ra_ = op_inc(ra_); break;
-		case INC_B: rb_ = op_inc(rb_); break;
-		case INC_C: rc_ = op_inc(rc_); break;
-		case INC_D: rd_ = op_inc(rd_); break;
-		case INC_E: re_ = op_inc(re_); break;
-		case INC_F: rf_ = op_inc(rf_); break;
-		case INC_L: rl_ = op_inc(rl_); break;
-		case INC_ind_HL: tmp = read(rhl()) + next(); write(tmp, op_inc(read(tmp))); break;
-		case DEC_A: ra_ = op_dec(ra_); break;
-		case DEC_B: rb_ = op_dec(rb_); break;
-		case DEC_C: rc_ = op_dec(rc_); break;
-		case DEC_D: rd_ = op_dec(rd_); break;
-		case DEC_E: re_ = op_dec(re_); break;
-		case DEC_F: rf_ = op_dec(rf_); break;
-		case DEC_L: rl_ = op_dec(rl_); break;
-		case DEC_ind_HL: tmp = read(rhl()) + next(); write(tmp, op_dec(read(tmp))); break;
-		case JP: rpc_ = next16(); break;
-		case JP_C: tmp16 = next16(); if (fc()) rpc_ = tmp16; break;
-		case JP_NC: tmp16 = next16(); if (!fc()) rpc_ = tmp16; break;
-		case JP_Z: tmp16 = next16(); if (fz()) rpc_ = tmp16; break;
-		case JP_NZ: tmp16 = next16(); if (!fz()) rpc_ = tmp16; break;
-		case JP_PO: tmp16 = next16(); if (!fpv()) rpc_ = tmp16; break;
-		case JP_PE: tmp16 = next16(); if (fpv()) rpc_ = tmp16; break;
-		case JP_M: tmp16 = next16(); if (fs()) rpc_ = tmp16; break;
-		case JP_P: tmp16 = next16(); if (!fs()) rpc_ = tmp16; break;
-		case JP_ind_HL: rpc_ = read(rhl()); break;
-		case JR: tmp = next(); rpc_ += *((int8_t*)&tmp); break;
-		case JR_C: tmp = next(); if (fc()) rpc_ += *((int8_t*)&tmp); break;
-		case JR_NC: tmp = next(); if (!fc()) rpc_ += *((int8_t*)&tmp); break;
-		case JR_Z: tmp = next(); if (fz()) rpc_ += *((int8_t*)&tmp); break;
-		case JR_NZ: tmp = next(); if (!fz()) rpc_ += *((int8_t*)&tmp); break;
-		case DJNZ: tmp = next(); if (--rb_) rpc_ += *((int8_t*)&tmp); break;
-		
-		case EXT_DD:
-			switch (code = next()) {
-				case DD_LD_B_imm: rb_ = next(); break;
-				case DD_LD_C_imm: rc_ = next(); break;
-				case DD_LD_D_imm: rd_ = next(); break;
-				case DD_LD_E_imm: re_ = next(); break;
-				case DD_LD_H_imm: rh_ = next(); break;
-				case DD_LD_A_idx_IY: ra_ = read(riy_ + next()); break;
-				case DD_LD_B_idx_IX: rb_ = read(rix_ + next()); break;
-				case DD_LD_C_idx_IX: rc_ = read(rix_ + next()); break;
-				case DD_LD_D_idx_IX: rd_ = read(rix_ + next()); break;
-				case DD_LD_E_idx_IX: re_ = read(rix_ + next()); break;
-				case DD_LD_H_idx_IX: rh_ = read(rix_ + next()); break;
-				case DD_LD_L_idx_IX: rl_ = read(rix_ + next()); break;
-				case DD_LD_idx_IX_A: write(rix_ + next(), ra_); break;
-				case DD_LD_idx_IX_B: write(rix_ + next(), rb_); break;
-				case DD_LD_idx_IX_C: write(rix_ + next(), rc_); break;
-				case DD_LD_idx_IX_D: write(rix_ + next(), rd_); break;
-				case DD_LD_idx_IX_E: write(rix_ + next(), re_); break;
-				case DD_LD_idx_IX_F: write(rix_ + next(), rf_); break;
-				case DD_LD_idx_IX_L: write(rix_ + next(), rl_); break;
-				case DD_LD_idx_IX_imm: write(rix_ + next(), next()); break;
-				case DD_LD_ind_HL_imm: write(rhl(), next()); break;
-				case DD_ADD_A_idx_IX: ra_ = op_add(ra_, read(rix_ + next())); break;
-				case DD_ADC_A_idx_IX: ra_ = op_adc(ra_, read(rix_ + next())); break;
-				case DD_SUB_A_idx_IX: ra_ = op_sub(ra_, read(rix_ + next())); break;
-				case DD_SBC_A_idx_IX: ra_ = op_sbc(ra_, read(rix_ + next())); break;
-				case DD_AND_A_idx_IX: ra_ = op_and(ra_, read(rix_ + next())); break;
-				case DD_XOR_A_idx_IX: ra_ = op_xor(ra_, read(rix_ + next())); break;
-				case DD_OR_A_idx_IX: ra_ = op_or(ra_, read(rix_ + next())); break;
-				case DD_CP_idx_IX: op_cp(read(rix_ + next())); break;
-				case DD_JP_ind_IX: rpc_ = read(rix_); break;
-
-				default:
-					cerr << "unknown 0xDD opcode: 0x" << (int)code << endl;
-					break;
+	// a client that hangs up with replies pending makes write() fail with
+	// EPIPE, which marks its connection broken, rather than killing us
+	struct sigaction ignore = {};
+	ignore.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &ignore, nullptr);
+	
+	vector<thread> pool;
+	for (unsigned n = 0; n < threads; n++)
+		pool.emplace_back(&Server::worker, this);
+	
+	struct sigaction act = {};
+	act.sa_handler = on_stop_signal;
+	sigaction(SIGINT, &act, nullptr);
+	sigaction(SIGTERM, &act, nullptr);
+	pthread_sigmask(SIG_SETMASK, &old_sigs, nullptr);
+	
+	vector<shared_ptr<Conn>> conns, kept;
+	vector<pollfd> fds;
+	if (listen_fd < 0)
+		conns.push_back(make_shared<Conn>(STDIN_FILENO, STDOUT_FILENO));
+	
+	Clock::time_point accept_after;
+	bool accept_failing = false;
+	
+	while (!stopping && (listen_fd >= 0 || !conns.empty())) {
+		// connections too far ahead of their replies, or with too much
+		// output the client hasn't taken, sit out a round, as does the
+		// listener after running out of descriptors
+		bool paused = accept_failing && Clock::now() < accept_after;
+		bool throttled = paused;
+		fds.clear();
+		fds.push_back(pollfd { wake_[0], POLLIN, 0 });
+		fds.push_back(pollfd { paused ? -1 : listen_fd, POLLIN, 0 });
+		for (auto& conn : conns) {
+			size_t unsent;
+			{
+				lock_guard<mutex> hold(conn->lock);
+				unsent = conn->unsent.size();
 			}
-			break;
-			
-		case EXT_ED:
-			switch (next()) {
-				case ED_LD_imp_I_A: ri_ = ra_; break;
-				case ED_LD_imp_R_A: rr_ = ra_; break;
-					
-				default:
-					cerr << "unknown 0xED opcode: 0x" << (int)code << endl;
-					break;
+			bool full = conn->lines - conn->answered >= MAX_PENDING || unsent > MAX_UNSENT;
+			throttled |= full && unsent <= MAX_UNSENT;
+			fds.push_back(pollfd { full || conn->done ? -1 : conn->in, POLLIN, 0 });
+			fds.push_back(pollfd { unsent ? conn->out : -1, POLLOUT, 0 });
+		}
+		
+		if (::poll(fds.data(), fds.size(), throttled ? 10 : -1) < 0)
+			continue;
+		
+		char drain[64];
+		if (fds[0].revents)
+			while (::read(wake_[0], drain, sizeof drain) > 0) {}
+		
+		const pollfd *ready = &fds[2];
+		kept.clear();
+		for (size_t n = 0; n < conns.size(); n++) {
+			Conn& conn = *conns[n];
+			if (ready[2 * n].revents)
+				read_lines(conns[n]);
+			if (ready[2 * n + 1].revents) {
+				lock_guard<mutex> hold(conn.lock);
+				flush(conn);
 			}
-			break;
-			
-		case EXT_FD:
-			switch (code = next()) {
-				case FD_LD_A_imm: ra_ = next(); break;
-				case FD_LD_A_ext: ra_ = read(next16()); break;
-				case FD_LD_A_idx_IX: ra_ = read(rix_ + next()); break;
-				case FD_LD_B_idx_IY: rb_ = read(riy_ + next()); break;
-				case FD_LD_C_idx_IY: rc_ = read(riy_ + next()); break;
-				case FD_LD_D_idx_IY: rd_ = read(riy_ + next()); break;
-				case FD_LD_E_idx_IY: re_ = read(riy_ + next()); break;
-				case FD_LD_H_idx_IY: rh_ = read(riy_ + next()); break;
-				case FD_LD_idx_IY_A: write(riy_ + next(), ra_); break;
-				case FD_LD_idx_IY_B: write(riy_ + next(), rb_); break;
-				case FD_LD_idx_IY_C: write(riy_ + next(), rc_); break;
-				case FD_LD_idx_IY_D: write(riy_ + next(), rd_); break;
-				case FD_LD_idx_IY_E: write(riy_ + next(), re_); break;
-				case FD_LD_idx_IY_F: write(riy_ + next(), rf_); break;
-				case FD_LD_idx_IY_L: write(riy_ + next(), rl_); break;
-				case FD_LD_idx_IY_imm: write(riy_ + next(), next()); break;
-				case FD_ADD_A_idx_IY: ra_ = op_add(ra_, read(riy_ + next())); break;
-				case FD_ADC_A_idx_IY: ra_ = op_adc(ra_, read(riy_ + next())); break;
-				case FD_SUB_A_idx_IY: ra_ = op_sub(ra_, read(riy_ + next())); break;
-				case FD_SBC_A_idx_IY: ra_ = op_sbc(ra_, read(riy_ + next())); break;
-				case FD_AND_A_idx_IY: ra_ = op_and(ra_, read(riy_ + next())); break;
-				case FD_XOR_A_idx_IY: ra_ = op_xor(ra_, read(riy_ + next())); break;
-				case FD_OR_A_idx_IY: ra_ = op_or(ra_, read(riy_ + next())); break;
-				case FD_CP_idx_IY: op_cp(read(riy_ + next())); break;
-				case FD_JP_ind_IY: rpc_ = read(riy_); break;
-					
-				default:
-					cerr << "unknown 0xFD opcode: 0x" << (int)code << endl;
-					break;
+			if (!finished(conn))
+				kept.push_back(conns[n]);
+		}
+		conns.swap(kept);
+		kept.clear();
+		
+		if (listen_fd >= 0 && fds[1].revents) {
+			int fd = ::accept(listen_fd, nullptr, nullptr);
+			if (fd >= 0 && ::fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+				cerr << "serve: fcntl: " << strerror(errno) << endl;
+				::close(fd);
+			} else if (fd >= 0) {
+				conns.push_back(make_shared<Conn>(fd, fd));
+				accept_failing = false;
+			} else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				if (!accept_failing)
+					cerr << "serve: accept: " << strerror(errno) << ", retrying" << endl;
+				accept_failing = true;
+				accept_after = Clock::now() + chrono::milliseconds(100);
+			} else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+				cerr << "serve: accept: " << strerror(errno) << endl;
+				break;
 			}
-			break;
-			
-		default:
-			cerr << "unknown opcode: 0x" << (int)code << endl;
-			break;
+		}
+	}
+	
+	if (listen_fd >= 0) {
+		::close(listen_fd);
+		::unlink(opts_.socket.c_str());
+	}
+	
+	jobs_.close();
+	for (auto& t : pool)
+		t.join();
+	
+	// replies to the jobs still queued go out as far as the clients take
+	// them without waiting; the connections close with the last reference
+	for (auto& conn : conns) {
+		lock_guard<mutex> hold(conn->lock);
+		flush(*conn);
 	}
+	conns.clear();
+	::close(wake_[0]);
+	::close(wake_[1]);
+	
+	report();
+	return 0;
+}
+
+static int usage()
+{
+	cerr << "usage: z80" << endl;
+	cerr << "       z80 fuzz [-j threads] [-n tests] [-t first] [-s seed]" << endl;
+	cerr << "                [-l length] [-c]" << endl;
+	cerr << "       z80 alu [-j threads] [-r rounds]" << endl;
+	cerr << "       z80 idle [-b] [-j threads] [-n tests] [-t first] [-s seed]" << endl;
+	cerr << "       z80 serve [-j threads] [-p pool] [-u socket] [-a rom addr] [-e entry]" << endl;
+	cerr << "                 [-o addr:len] [-c cycles] [-m access prefix]" << endl;
+	cerr << "                 [-w window] rom" << endl;
+	return 2;
 }
 
-void Z80::run_to_nop(bool print)
+static int alu_main(int argc, char **argv)
 {
-	if (print) {
-		dump_regs();
-		cout << endl;
+	unsigned threads = 0;
+	int rounds = 5;
+	
+	for (int n = 0; n < argc; n++) {
+		string arg = argv[n];
+		if (n + 1 >= argc)
+			return usage();
+		
+		long val = strtol(argv[++n], nullptr, 0);
+		if (arg == "-j" && val >= 0)
+			threads = (unsigned)val;
+		else if (arg == "-r" && val > 0)
+			rounds = (int)val;
+		else
+			return usage();
 	}
 	
-	while (read(rpc_)) {
-		if (print) {
-			cout << "> " << pc_str() << endl << endl;
+	return AluCheck(threads, rounds).run() ? 0 : 1;
+}
+
+static int fuzz_main(int argc, char **argv)
+{
+	FuzzOptions opts;
+	
+	for (int n = 0; n < argc; n++) {
+		string arg = argv[n];
+		if (arg == "-c") {
+			opts.compact = true;
+			continue;
 		}
+		if (n + 1 >= argc)
+			return usage();
 		
-		step();
+		unsigned long long val = strtoull(argv[++n], nullptr, 0);
+		if (arg == "-j")
+			opts.threads = (unsigned)val;
+		else if (arg == "-n")
+			opts.tests = val;
+		else if (arg == "-t")
+			opts.first = val;
+		else if (arg == "-s")
+			opts.seed = val;
+		else if (arg == "-l" && val > 0 && val < 1000)
+			opts.length = (int)val;
+		else
+			return usage();
+	}
+	
+	return Fuzzer(opts).run_all() ? 0 : 1;
+}
+
+static int idle_main(int argc, char **argv)
+{
+	IdleOptions opts;
+	
+	for (int n = 0; n < argc; n++) {
+		string arg = argv[n];
+		if (arg == "-b") {
+			opts.block = true;
+			continue;
+		}
+		if (n + 1 >= argc)
+			return usage();
 		
-		if (print) {
-			dump_regs();
-			cout << endl;
+		unsigned long long val = strtoull(argv[++n], nullptr, 0);
+		if (arg == "-j")
+			opts.threads = (unsigned)val;
+		else if (arg == "-n")
+			opts.tests = val;
+		else if (arg == "-t")
+			opts.first = val;
+		else if (arg == "-s")
+			opts.seed = val;
+		else
+			return usage();
+	}
+	
+	return IdleCheck(opts).run_all() ? 0 : 1;
+}
+
+static int serve_main(int argc, char **argv)
+{
+	ServeOptions opts;
+	
+	for (int n = 0; n < argc; n++) {
+		string arg = argv[n];
+		if (n + 1 == argc && arg[0] != '-') {
+			opts.rom = arg;
+			break;
 		}
+		if (n + 1 >= argc)
+			return usage();
+		
+		const char *val = argv[++n];
+		char *end;
+		unsigned long long num = strtoull(val, &end, 0);
+		if (arg == "-u")
+			opts.socket = val;
+		else if (arg == "-m")
+			opts.access_prefix = val;
+		else if (arg == "-w" && num > 0)
+			opts.window = num;
+		else if (arg == "-j")
+			opts.threads = (unsigned)num;
+		else if (arg == "-p" && num > 0 && num < 1000)
+			opts.pool = (unsigned)num;
+		else if (arg == "-a" && num < MEM_SIZE && !(num & (PAGE_SIZE - 1)))
+			opts.rom_addr = (uint16_t)num;
+		else if (arg == "-e" && num < MEM_SIZE)
+			opts.entry = (int)num;
+		else if (arg == "-c" && num > 0)
+			opts.limit = num;
+		else if (arg == "-o" && *end == ':' && num < MEM_SIZE) {
+			unsigned long len = strtoul(end + 1, nullptr, 0);
+			if (!len || num + len > MEM_SIZE)
+				return usage();
+			opts.out_addr = (uint16_t)num;
+			opts.out_len = (uint16_t)len;
+		} else
+			return usage();
+	}
+	
+	if (opts.rom.empty())
+		return usage();
+	
+	ifstream file(opts.rom, ios::binary);
+	if (!file) {
+		cerr << "serve: can't read " << opts.rom << endl;
+		return 1;
 	}
 	
-	if (print) {
-		cout << "> noop" << endl;
+	vector<uint8_t> rom((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	if (rom.empty() || opts.rom_addr + rom.size() > MEM_SIZE) {
+		cerr << "serve: " << opts.rom << " doesn't fit at " << opts.rom_addr << endl;
+		return 1;
 	}
+	
+	return Server(opts, rom).run();
 }
 
-int main()
+int main(int argc, char **argv)
 {
+	if (argc > 1) {
+		if (string(argv[1]) == "fuzz")
+			return fuzz_main(argc - 2, argv + 2);
+		if (string(argv[1]) == "alu")
+			return alu_main(argc - 2, argv + 2);
+		if (string(argv[1]) == "idle")
+			return idle_main(argc - 2, argv + 2);
+		if (string(argv[1]) == "serve")
+			return serve_main(argc - 2, argv + 2);
+		return usage();
+	}
+	
 	Z80 cpu;
 	cpu.ram() = {
 		JR, 0x0C,                     //  -+
@@ -1000,5 +2212,5 @@ int main()
 		NOOP
 	};
 
-	cpu.run_to_nop(true);
+	cpu.run_to_nop(&cout);
 }
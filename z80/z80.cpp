@@ -0,0 +1,2576 @@
+//
+//  z80.cpp
+//  z80
+//
+
+#include "z80.h"
+
+#include <ostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <new>
+#include <cstring>
+#include <cctype>
+#include <utility>
+#include <bitset>
+#include <map>
+
+#include <signal.h>
+#include <sys/time.h>
+
+using namespace std;
+
+// T-states per opcode. Prefixed opcodes are charged 4 for the prefix here
+// and the rest from CYCLES_IDX or in the ED cases themselves. Conditional
+// relative jumps add 5 when taken, conditional calls 7 and conditional
+// returns 6, repeating block instructions add 5 per repeat.
+static const uint8_t CYCLES[256] = {
+	 4, 10,  7,  6,  4,  4,  7,  4,  4, 11,  7,  6,  4,  4,  7,  4,
+	 8, 10,  7,  6,  4,  4,  7,  4, 12, 11,  7,  6,  4,  4,  7,  4,
+	 7, 10, 16,  6,  4,  4,  7,  4,  7, 11, 16,  6,  4,  4,  7,  4,
+	 7, 10, 13,  6, 11, 11, 10,  4,  7, 11, 13,  6,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 7,  7,  7,  7,  7,  7,  4,  7,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 5, 10, 10, 10, 10, 11,  7, 11,  5, 10, 10,  4, 10, 17,  7, 11,
+	 5, 10, 10, 11, 10, 11,  7, 11,  5,  4, 10, 11, 10,  4,  7, 11,
+	 5, 10, 10, 19, 10, 11,  7, 11,  5,  4, 10,  4, 10,  4,  7, 11,
+	 5, 10, 10,  4, 10, 11,  7, 11,  5,  6, 10,  4, 10,  4,  7, 11
+};
+
+// T-states for the DD and FD pages, excluding the prefix.
+static const uint8_t CYCLES_IDX[256] = {
+	 4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,
+	 4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  7,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  7,  4,  4,  7,  4,
+	 4,  4,  4,  4, 19, 19, 15,  4,  4,  4, 13,  4,  4,  4,  4,  4,
+	 4,  4,  4,  4,  4,  4, 15,  4,  4,  4,  4,  4,  4,  4, 15,  4,
+	 4,  4,  4,  4,  4,  4, 15,  4,  4,  4,  4,  4,  4,  4, 15,  4,
+	 4,  4,  4,  4,  4,  4, 15,  4,  4,  4,  4,  4,  4,  4, 15,  4,
+	15, 15, 15, 15, 15, 15,  4, 15, 10,  4,  4,  4,  4,  4, 15,  4,
+	 4,  4,  4,  4,  4,  4, 15,  4,  4,  4,  4,  4,  4,  4, 15,  4,
+	 4,  4,  4,  4,  4,  4, 15,  4,  4,  4,  4,  4,  4,  4, 15,  4,
+	 4,  4,  4,  4,  4,  4, 15,  4,  4,  4,  4,  4,  4,  4, 15,  4,
+	 4,  4,  4,  4,  4,  4, 15,  4,  4,  4,  4,  4,  4,  4, 15,  4,
+	 4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,
+	 4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+	 4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,
+	 4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4
+};
+
+// S, Z and parity (PV) flags of each 8-bit result.
+static const uint8_t FLAGS_SZP[256] = {
+	0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84
+};
+
+uint8_t Z80Base::w_calc_flags(uint8_t a, uint8_t b, uint8_t carry, bool is_sub)
+{
+	unsigned result = is_sub ? a - b - carry : a + b + carry;
+	unsigned overflow = is_sub ? (a ^ b) & (a ^ result) : ~(a ^ b) & (a ^ result);
+	
+	// C is bit 8 of the result for both signs, H the carry into bit 4,
+	// PV the sign overflow moved from bit 7 to bit 2
+	r_.f = (FLAGS_SZP[(uint8_t)result] & (FLAG_S | FLAG_Z))
+		| (result >> 8 & FLAG_C)
+		| (is_sub ? FLAG_N : 0)
+		| (overflow >> 5 & FLAG_PV)
+		| ((a ^ b ^ result) & FLAG_H);
+	
+	return (uint8_t)result;
+}
+
+uint8_t Z80Base::w_logic_flags(uint8_t result, bool half)
+{
+	r_.f = FLAGS_SZP[result] | (half ? FLAG_H : 0);
+	return result;
+}
+
+// INC and DEC set flags like ADD and SUB with 1 but leave carry alone.
+uint8_t Z80Base::op_incdec(uint8_t a, bool is_sub)
+{
+	uint8_t carry = r_.f & FLAG_C;
+	uint8_t result = w_calc_flags(a, 1, 0, is_sub);
+	
+	r_.f = (r_.f & ~FLAG_C) | carry;
+	return result;
+}
+
+void Z80Base::op_add16(uint16_t val)
+{
+	uint32_t result = (uint32_t)r_.hl + val;
+	
+	r_.f &= ~(FLAG_H | FLAG_N | FLAG_C);
+	if ((r_.hl ^ val ^ result) & 0x1000) r_.f |= FLAG_H;
+	if (result & 0x10000) r_.f |= FLAG_C;
+	
+	r_.hl = (uint16_t)result;
+}
+
+uint8_t *PageArena::alloc()
+{
+	lock_guard<mutex> guard(lock_);
+	
+	used_++;
+	if (!free_.empty()) {
+		uint8_t *page = free_.back();
+		free_.pop_back();
+		return page;
+	}
+	
+	if (next_ == CHUNK_PAGES) {
+		chunks_.emplace_back(new uint8_t[CHUNK_PAGES * PAGE_SIZE]);
+		next_ = 0;
+	}
+	return &chunks_.back()[next_++ * PAGE_SIZE];
+}
+
+void PageArena::free(uint8_t *page)
+{
+	lock_guard<mutex> guard(lock_);
+	
+	free_.push_back(page);
+	used_--;
+}
+
+size_t PageArena::pages_used() const
+{
+	lock_guard<mutex> guard(lock_);
+	return used_;
+}
+
+size_t PageArena::bytes_reserved() const
+{
+	lock_guard<mutex> guard(lock_);
+	return chunks_.size() * CHUNK_PAGES * PAGE_SIZE;
+}
+
+PageArena& PageArena::shared()
+{
+	static PageArena arena;
+	return arena;
+}
+
+uint8_t *PageArena::zero_page()
+{
+	static uint8_t page[PAGE_SIZE];
+	return page;
+}
+
+RomImage::RomImage(const uint8_t *data, size_t len)
+	: data_((len + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1))
+{
+	if (len)
+		memcpy(data_.data(), data, len);
+}
+
+template <class Policy>
+Z80Core<Policy>::Z80Core(PageArena *arena)
+{
+	init_memory(storage_.flat(), !Policy::compact ? nullptr : arena ? arena : &PageArena::shared());
+}
+
+template <class Policy>
+void Z80Core<Policy>::op_ldi(int dir)
+{
+	write(r_.de, read(r_.hl));
+	r_.hl += dir;
+	r_.de += dir;
+	r_.bc--;
+	
+	r_.f &= ~(FLAG_H | FLAG_N | FLAG_PV);
+	if (r_.bc) r_.f |= FLAG_PV;
+}
+
+template <class Policy>
+void Z80Core<Policy>::op_cpi(int dir)
+{
+	uint8_t carry = r_.f & FLAG_C;
+	
+	op_cp(read(r_.hl));
+	r_.hl += dir;
+	r_.bc--;
+	
+	r_.f = (r_.f & ~(FLAG_C | FLAG_PV)) | carry;
+	if (r_.bc) r_.f |= FLAG_PV;
+}
+
+template <class Policy>
+void Z80Core<Policy>::op_ini()
+{
+	write(r_.hl, ports_[r_.c]);
+	r_.hl += 1;
+	r_.b--;
+	
+	r_.f = (r_.f & FLAG_C) | FLAG_N;
+	if (!r_.b) r_.f |= FLAG_Z;
+}
+
+template <class Policy>
+void Z80Core<Policy>::op_outi()
+{
+	r_.b--;
+	ports_[r_.c] = read(r_.hl);
+	r_.hl += 1;
+	
+	r_.f = (r_.f & FLAG_C) | FLAG_N;
+	if (!r_.b) r_.f |= FLAG_Z;
+}
+
+// Whether len bytes starting at addr and going in direction dir can be
+// processed in bulk: they must not wrap around the address space and,
+// if written to, must not overwrite the instruction at PC. Nothing may
+// be watched and no breakpoint set on the instruction's page, since the
+// iterations done in bulk are never seen by check_breakpoint(). Compact
+// cores have no contiguous memory to work on.
+template <class Policy>
+bool Z80Core<Policy>::can_bulk(uint16_t addr, uint32_t len, int dir, bool writes) const
+{
+	int32_t lo = dir > 0 ? addr : (int32_t)addr - (int32_t)len + 1;
+	int32_t hi = lo + (int32_t)len - 1;
+	
+	if (Policy::compact || !fast_block_ || lo < 0 || hi >= MEM_SIZE)
+		return false;
+	if (Policy::profile && access_)
+		return false;
+	if (writes && lo <= r_.pc + 1 && hi >= r_.pc)
+		return false;
+	if (Policy::watch && (!watchpoints_.empty() || (page_flags_[r_.pc >> PAGE_BITS] & PAGE_BREAK)))
+		return false;
+	
+	return true;
+}
+
+// Called by the run loops once a repeating block instruction at pc has
+// run an iteration and jumped back to itself. Performs all but the last
+// of the remaining iterations at once, but no more than fit between now
+// and end, leaving the next iteration to the regular single-step path so
+// flags come out as if iterated one by one. Like idle_skip() it returns
+// the cycles taken, or instructions on cores that don't count cycles.
+template <class Policy>
+uint64_t Z80Core<Policy>::bulk_repeat(uint16_t pc, uint64_t now, uint64_t end)
+{
+	if (now >= end || mem(pc) != EXT_ED)
+		return 0;
+	
+	uint64_t unit = Policy::cycles ? 21 : 1;
+	uint64_t room = (end - now - 1) / unit;
+	uint32_t k;
+	
+	switch (mem((uint16_t)(pc + 1))) {
+		case ED_LDIR: k = bulk_ld(1, room); break;
+		case ED_LDDR: k = bulk_ld(-1, room); break;
+		case ED_CPIR: k = bulk_cp(room); break;
+		case ED_INIR: k = bulk_in(room); break;
+		case ED_OTIR: k = bulk_out(room); break;
+		default: return 0;
+	}
+	
+	return k * unit;
+}
+
+// The bulk_* functions perform up to room iterations of their
+// instruction, stopping short of the last one, and return how many.
+
+template <class Policy>
+uint32_t Z80Core<Policy>::bulk_ld(int dir, uint64_t room)
+{
+	uint32_t n = r_.bc ? r_.bc : 0x10000;
+	uint32_t k = (uint32_t)min<uint64_t>(n - 1, room);
+	uint16_t src = r_.hl;
+	uint16_t dst = r_.de;
+	
+	if (!k || !can_bulk(src, k, dir, false) || !can_bulk(dst, k, dir, true))
+		return 0;
+	
+	uint8_t *ram = storage_.data();
+	if (dir > 0) {
+		if (dst > src && dst < src + k) {
+			// overlapping copy that repeats a pattern, must go bytewise
+			for (uint32_t i = 0; i < k; i++)
+				ram[dst + i] = ram[src + i];
+		} else {
+			memmove(&ram[dst], &ram[src], k);
+		}
+	} else {
+		if (dst < src && dst > src - k) {
+			for (uint32_t i = 0; i < k; i++)
+				ram[dst - i] = ram[src - i];
+		} else {
+			memmove(&ram[dst - k + 1], &ram[src - k + 1], k);
+		}
+	}
+	
+	r_.hl = src + dir * (int32_t)k;
+	r_.de = dst + dir * (int32_t)k;
+	r_.bc = n - k;
+	tick(21 * k);
+	return k;
+}
+
+template <class Policy>
+uint32_t Z80Core<Policy>::bulk_cp(uint64_t room)
+{
+	uint32_t n = r_.bc ? r_.bc : 0x10000;
+	uint32_t k = (uint32_t)min<uint64_t>(n - 1, room);
+	uint16_t src = r_.hl;
+	
+	if (!k || !can_bulk(src, k, 1, false))
+		return 0;
+	
+	const uint8_t *ram = storage_.data();
+	const uint8_t *hit = (const uint8_t *)memchr(&ram[src], r_.a, k);
+	if (hit)
+		k = (uint32_t)(hit - &ram[src]);
+	
+	r_.hl = src + k;
+	r_.bc = n - k;
+	tick(21 * k);
+	return k;
+}
+
+template <class Policy>
+uint32_t Z80Core<Policy>::bulk_in(uint64_t room)
+{
+	uint32_t n = r_.b ? r_.b : 0x100;
+	uint32_t k = (uint32_t)min<uint64_t>(n - 1, room);
+	uint16_t dst = r_.hl;
+	
+	if (!k || !can_bulk(dst, k, 1, true))
+		return 0;
+	
+	memset(&storage_.data()[dst], ports_[r_.c], k);
+	
+	r_.hl = dst + k;
+	r_.b = n - k;
+	tick(21 * k);
+	return k;
+}
+
+template <class Policy>
+uint32_t Z80Core<Policy>::bulk_out(uint64_t room)
+{
+	uint32_t n = r_.b ? r_.b : 0x100;
+	uint32_t k = (uint32_t)min<uint64_t>(n - 1, room);
+	uint16_t src = r_.hl;
+	
+	if (!k || !can_bulk(src, k, 1, false))
+		return 0;
+	
+	ports_[r_.c] = storage_.data()[src + k - 1];
+	
+	r_.hl = src + k;
+	r_.b = n - k;
+	tick(21 * k);
+	return k;
+}
+
+class ConditionParser {
+	struct BinOp {
+		const char *tok;
+		int prec;
+		Condition::Code code;
+	};
+	
+	static const BinOp BINOPS[];
+	static const char *const REG_NAMES[];
+	
+	const char *p_;
+	vector<uint8_t>& code_;
+	string error_;
+	int depth_ = 0;
+	
+	void skip_space() { while (isspace((unsigned char)*p_)) p_++; }
+	bool fail(const string& msg) { if (error_.empty()) error_ = msg; return false; }
+	bool emit(uint8_t op, int effect);
+	bool parse_expr(int min_prec);
+	bool parse_unary();
+	bool parse_primary();
+	
+public:
+	ConditionParser(const string& expr, vector<uint8_t>& code)
+		: p_(expr.c_str()), code_(code) {}
+	
+	bool parse();
+	const string& error() const { return error_; }
+};
+
+// Longer tokens first so "<=" is not taken for "<".
+const ConditionParser::BinOp ConditionParser::BINOPS[] = {
+	{ "||", 1, Condition::C_LOR },
+	{ "&&", 2, Condition::C_LAND },
+	{ "==", 6, Condition::C_EQ },
+	{ "!=", 6, Condition::C_NE },
+	{ "<=", 7, Condition::C_LE },
+	{ ">=", 7, Condition::C_GE },
+	{ "|", 3, Condition::C_OR },
+	{ "^", 4, Condition::C_XOR },
+	{ "&", 5, Condition::C_AND },
+	{ "<", 7, Condition::C_LT },
+	{ ">", 7, Condition::C_GT },
+	{ "+", 8, Condition::C_ADD },
+	{ "-", 8, Condition::C_SUB },
+	{ nullptr, 0, Condition::C_CONST }
+};
+
+// In Condition::Reg order.
+const char *const ConditionParser::REG_NAMES[] = {
+	"a", "f", "b", "c", "d", "e", "h", "l",
+	"af", "bc", "de", "hl", "ix", "iy", "sp", "pc", "i", "r"
+};
+
+bool ConditionParser::emit(uint8_t op, int effect)
+{
+	depth_ += effect;
+	if (depth_ > Condition::MAX_DEPTH)
+		return fail("expression too deep");
+	
+	code_.push_back(op);
+	return true;
+}
+
+bool ConditionParser::parse()
+{
+	skip_space();
+	if (!*p_)
+		return true;
+	if (!parse_expr(1))
+		return false;
+	
+	skip_space();
+	if (*p_)
+		return fail(string("unexpected '") + *p_ + "'");
+	
+	return true;
+}
+
+bool ConditionParser::parse_expr(int min_prec)
+{
+	if (!parse_unary())
+		return false;
+	
+	for (;;) {
+		skip_space();
+		
+		const BinOp *op = BINOPS;
+		while (op->tok && strncmp(p_, op->tok, strlen(op->tok)))
+			op++;
+		if (!op->tok || op->prec < min_prec)
+			return true;
+		
+		p_ += strlen(op->tok);
+		if (!parse_expr(op->prec + 1) || !emit(op->code, -1))
+			return false;
+	}
+}
+
+bool ConditionParser::parse_unary()
+{
+	skip_space();
+	
+	if (*p_ == '!') {
+		p_++;
+		return parse_unary() && emit(Condition::C_NOT, 0);
+	}
+	if (*p_ == '~') {
+		p_++;
+		return parse_unary() && emit(Condition::C_BNOT, 0);
+	}
+	
+	return parse_primary();
+}
+
+bool ConditionParser::parse_primary()
+{
+	skip_space();
+	
+	if (*p_ == '(' || *p_ == '[') {
+		char close = *p_ == '(' ? ')' : ']';
+		p_++;
+		if (!parse_expr(1))
+			return false;
+		skip_space();
+		if (*p_ != close)
+			return fail(string("expected '") + close + "'");
+		p_++;
+		return close == ']' ? emit(Condition::C_MEM, 0) : true;
+	}
+	
+	if (isdigit((unsigned char)*p_)) {
+		char *end;
+		unsigned long val = strtoul(p_, &end, 0);
+		if (val > 0xFFFF)
+			return fail("constant out of range");
+		p_ = end;
+		if (!emit(Condition::C_CONST, 1))
+			return false;
+		code_.push_back((uint8_t)(val >> 8));
+		code_.push_back((uint8_t)val);
+		return true;
+	}
+	
+	if (isalpha((unsigned char)*p_)) {
+		const char *start = p_;
+		while (isalnum((unsigned char)*p_))
+			p_++;
+		string name(start, p_);
+		transform(name.begin(), name.end(), name.begin(), ::tolower);
+		
+		if (name == "val")
+			return emit(Condition::C_VAL, 1);
+		for (int i = 0; i < Condition::R_COUNT; i++) {
+			if (name == REG_NAMES[i]) {
+				if (!emit(Condition::C_REG, 1))
+					return false;
+				code_.push_back((uint8_t)i);
+				return true;
+			}
+		}
+		return fail("unknown name '" + name + "'");
+	}
+	
+	return *p_ ? fail(string("unexpected '") + *p_ + "'") : fail("unexpected end");
+}
+
+bool Condition::compile(const string& expr, Condition& cond, string* error)
+{
+	vector<uint8_t> code;
+	ConditionParser parser(expr, code);
+	
+	if (!parser.parse()) {
+		if (error)
+			*error = parser.error();
+		return false;
+	}
+	
+	cond.code_.swap(code);
+	return true;
+}
+
+CallProfiler::CallProfiler(uint64_t now)
+	: stats_(0x10000), active_(0x10000)
+{
+	nodes_.push_back(Node { 0, 0, 0 });
+	frames_.push_back(Frame { 0, 0, 0, now, 0 });
+}
+
+void CallProfiler::call(uint16_t target, uint16_t sp, uint64_t now)
+{
+	uint32_t parent = frames_.back().node;
+	uint64_t key = (uint64_t)parent << 16 | target;
+	uint32_t node;
+	
+	auto it = edges_.find(key);
+	if (it != edges_.end()) {
+		node = it->second;
+	} else {
+		node = (uint32_t)nodes_.size();
+		nodes_.push_back(Node { target, parent, 0 });
+		edges_.emplace(key, node);
+	}
+	
+	stats_[target].calls++;
+	active_[target]++;
+	frames_.push_back(Frame { node, target, sp, now, 0 });
+}
+
+void CallProfiler::ret(uint16_t sp, uint64_t now)
+{
+	// frames entered with a lower SP were abandoned by the guest
+	while (frames_.size() > 1 && frames_.back().sp < sp)
+		leave(now);
+	
+	if (frames_.size() > 1 && frames_.back().sp == sp)
+		leave(now);
+}
+
+void CallProfiler::leave(uint64_t now)
+{
+	Frame frame = frames_.back();
+	frames_.pop_back();
+	
+	uint64_t inclusive = now - frame.entered;
+	uint64_t exclusive = inclusive - frame.children;
+	Stats& stats = stats_[frame.addr];
+	
+	// recursive activations are already covered by the outermost one
+	if (--active_[frame.addr] == 0)
+		stats.inclusive += inclusive;
+	stats.exclusive += exclusive;
+	nodes_[frame.node].self += exclusive;
+	frames_.back().children += inclusive;
+}
+
+size_t CallProfiler::stack(uint16_t *addrs, size_t max) const
+{
+	size_t n = min(max, frames_.size() - 1);
+	
+	for (size_t i = 0; i < n; i++)
+		addrs[i] = frames_[frames_.size() - n + i].addr;
+	
+	return n;
+}
+
+string CallProfiler::node_path(uint32_t node) const
+{
+	vector<uint16_t> addrs;
+	for (; node; node = nodes_[node].parent)
+		addrs.push_back(nodes_[node].addr);
+	
+	stringstream str;
+	str << "root" << hex << setfill('0');
+	for (auto it = addrs.rbegin(); it != addrs.rend(); ++it)
+		str << ";0x" << setw(4) << *it;
+	
+	return str.str();
+}
+
+void CallProfiler::write_report(ostream& out, uint64_t now) const
+{
+	vector<uint16_t> addrs;
+	for (uint32_t addr = 0; addr < 0x10000; addr++)
+		if (stats_[addr].calls)
+			addrs.push_back(addr);
+	
+	sort(addrs.begin(), addrs.end(), [this](uint16_t a, uint16_t b) {
+		return stats_[a].inclusive > stats_[b].inclusive;
+	});
+	
+	out << "total cycles: " << dec << now - frames_.front().entered << endl;
+	out << "addr        calls    inclusive    exclusive" << endl;
+	
+	for (uint16_t addr : addrs) {
+		const Stats& stats = stats_[addr];
+		out << "0x" << hex << setfill('0') << setw(4) << addr
+			<< dec << setfill(' ')
+			<< setw(11) << stats.calls
+			<< setw(13) << stats.inclusive
+			<< setw(13) << stats.exclusive << endl;
+	}
+}
+
+void CallProfiler::write_folded(ostream& out, uint64_t now) const
+{
+	// cycles of frames still open are attributed as if they returned now
+	vector<uint64_t> self(nodes_.size());
+	for (size_t i = 0; i < nodes_.size(); i++)
+		self[i] = nodes_[i].self;
+	for (const Frame& frame : frames_)
+		self[frame.node] += now - frame.entered - frame.children;
+	for (size_t i = 1; i < frames_.size(); i++)
+		self[frames_[i - 1].node] -= now - frames_[i].entered;
+	
+	for (size_t i = 0; i < nodes_.size(); i++)
+		if (self[i])
+			out << node_path((uint32_t)i) << " " << dec << self[i] << endl;
+}
+
+AccessProfiler::AccessProfiler(uint64_t now, uint64_t window)
+	: start_(now), window_(window ? window : 1), window_start_(now), windows_(1)
+{
+	first_.fill(~0ull);
+}
+
+// Switches to the window holding now, which may be an earlier one.
+void AccessProfiler::move_to(uint64_t now)
+{
+	windows_[current_] = mask_;
+	uint64_t index = now < start_ ? 0 : (now - start_) / window_;
+	for (; index >= MAX_WINDOWS; index /= 2)
+		widen();
+	
+	current_ = (size_t)index;
+	if (current_ >= windows_.size())
+		windows_.resize(current_ + 1);
+	window_start_ = start_ + current_ * window_;
+	mask_ = windows_[current_];
+}
+
+// Merges each pair of windows into one of twice the length.
+void AccessProfiler::widen()
+{
+	windows_[current_] = mask_;
+	size_t count = windows_.size();
+	for (size_t n = 0; n < count; n += 2)
+		windows_[n / 2] = windows_[n] | (n + 1 < count ? windows_[n + 1] : 0);
+	windows_.resize((count + 1) / 2);
+	
+	window_ *= 2;
+	current_ /= 2;
+	window_start_ = start_ + current_ * window_;
+	mask_ = windows_[current_];
+}
+
+AccessProfiler::Page AccessProfiler::page(int page) const
+{
+	return Page { reads_[page], writes_[page], fetches_[page], first_[page], last_[page] };
+}
+
+vector<int> AccessProfiler::working_set() const
+{
+	vector<int> pages;
+	for (size_t n = 0; n < windows_.size(); n++)
+		pages.push_back((int)bitset<PAGE_COUNT>(n == current_ ? mask_ : windows_[n]).count());
+	
+	return pages;
+}
+
+void AccessProfiler::merge(const AccessProfiler& other)
+{
+	for (int page = 0; page < PAGE_COUNT; page++) {
+		reads_[page] += other.reads_[page];
+		writes_[page] += other.writes_[page];
+		fetches_[page] += other.fetches_[page];
+		first_[page] = min(first_[page], other.first_[page]);
+		last_[page] = max(last_[page], other.last_[page]);
+	}
+	
+	while (window_ < other.window_)
+		widen();
+	
+	// other's windows are as long as these or a power of two shorter
+	uint64_t ratio = window_ / other.window_;
+	size_t count = (size_t)((other.windows_.size() + ratio - 1) / ratio);
+	windows_[current_] = mask_;
+	if (windows_.size() < count)
+		windows_.resize(count);
+	for (size_t n = 0; n < other.windows_.size(); n++)
+		windows_[n / ratio] |= n == other.current_ ? other.mask_ : other.windows_[n];
+	mask_ = windows_[current_];
+}
+
+void AccessProfiler::write_csv(ostream& out) const
+{
+	out << "page,addr,reads,writes,fetches,first,last" << endl;
+	
+	for (int page = 0; page < PAGE_COUNT; page++) {
+		out << dec << page << "," << page * PAGE_SIZE << "," << reads_[page] << ","
+			<< writes_[page] << "," << fetches_[page] << ",";
+		if (first_[page] != ~0ull)
+			out << first_[page] << "," << last_[page];
+		else
+			out << ",";
+		out << endl;
+	}
+}
+
+void AccessProfiler::write_working_set_csv(ostream& out) const
+{
+	vector<int> pages = working_set();
+	
+	out << "window,start,pages,bytes" << endl;
+	for (size_t n = 0; n < pages.size(); n++)
+		out << dec << n << "," << n * window_ << "," << pages[n] << ","
+			<< pages[n] * PAGE_SIZE << endl;
+}
+
+void AccessProfiler::write_json(ostream& out) const
+{
+	out << dec << "{\"page_size\":" << PAGE_SIZE << ",\"window\":" << window_ << ",\"pages\":[";
+	
+	for (int page = 0; page < PAGE_COUNT; page++) {
+		out << (page ? "," : "") << "{\"page\":" << page << ",\"reads\":" << reads_[page]
+			<< ",\"writes\":" << writes_[page] << ",\"fetches\":" << fetches_[page];
+		if (first_[page] != ~0ull)
+			out << ",\"first\":" << first_[page] << ",\"last\":" << last_[page];
+		out << "}";
+	}
+	
+	out << "],\"working_set\":[";
+	vector<int> pages = working_set();
+	for (size_t n = 0; n < pages.size(); n++)
+		out << (n ? "," : "") << pages[n];
+	out << "]}" << endl;
+}
+
+atomic<bool> SampleProfiler::due(false);
+
+static atomic<SampleProfiler *> sampling(nullptr);
+static struct sigaction old_sigprof;
+
+static void on_sigprof(int)
+{
+	SampleProfiler::due.store(true, memory_order_relaxed);
+}
+
+SampleProfiler::SampleProfiler(size_t capacity)
+	: ring_(capacity ? capacity : 1), next_(0)
+{
+}
+
+SampleProfiler::~SampleProfiler()
+{
+	stop();
+}
+
+bool SampleProfiler::start(unsigned hz)
+{
+	SampleProfiler *none = nullptr;
+	if (!hz || !sampling.compare_exchange_strong(none, this))
+		return false;
+	
+	struct sigaction action = {};
+	action.sa_handler = on_sigprof;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	
+	unsigned usec = max(1u, 1000000 / hz);
+	struct itimerval timer = {};
+	timer.it_interval.tv_sec = usec / 1000000;
+	timer.it_interval.tv_usec = usec % 1000000;
+	timer.it_value = timer.it_interval;
+	
+	if (sigaction(SIGPROF, &action, &old_sigprof)) {
+		sampling = nullptr;
+		return false;
+	}
+	if (setitimer(ITIMER_PROF, &timer, nullptr)) {
+		sigaction(SIGPROF, &old_sigprof, nullptr);
+		sampling = nullptr;
+		return false;
+	}
+	
+	return true;
+}
+
+void SampleProfiler::stop()
+{
+	if (sampling != this)
+		return;
+	
+	struct itimerval timer = {};
+	setitimer(ITIMER_PROF, &timer, nullptr);
+	sigaction(SIGPROF, &old_sigprof, nullptr);
+	due = false;
+	sampling = nullptr;
+}
+
+void SampleProfiler::record(uint16_t pc, uint8_t page, const CallProfiler *calls)
+{
+	Sample& sample = ring_[next_++ % ring_.size()];
+	
+	sample.pc = pc;
+	sample.page = page;
+	sample.depth = calls ? (uint8_t)calls->stack(sample.stack, MAX_STACK) : 0;
+}
+
+size_t SampleProfiler::size() const
+{
+	return (size_t)min<uint64_t>(next_, ring_.size());
+}
+
+void SampleProfiler::write_report(ostream& out, Z80Base& cpu, size_t top) const
+{
+	unordered_map<uint16_t, uint64_t> counts;
+	for (size_t i = 0; i < size(); i++)
+		counts[ring_[i].pc]++;
+	
+	vector<pair<uint16_t, uint64_t>> hot(counts.begin(), counts.end());
+	sort(hot.begin(), hot.end(), [](const pair<uint16_t, uint64_t>& a, const pair<uint16_t, uint64_t>& b) {
+		return a.second != b.second ? a.second > b.second : a.first < b.first;
+	});
+	if (hot.size() > top)
+		hot.resize(top);
+	
+	out << "samples: " << dec << size();
+	if (next_ > ring_.size())
+		out << " (latest of " << next_ << ")";
+	out << endl;
+	out << "  samples   share  addr    instruction" << endl;
+	
+	for (auto& entry : hot) {
+		out << setw(9) << dec << setfill(' ') << entry.second << " " << fixed << setprecision(1)
+			<< setw(6) << 100.0 * entry.second / size() << "%  0x" << hex << setfill('0')
+			<< setw(4) << entry.first << "  " << cpu.disassemble(entry.first) << endl;
+	}
+	out << dec << setfill(' ');
+}
+
+void SampleProfiler::write_folded(ostream& out) const
+{
+	map<string, uint64_t> stacks;
+	
+	for (size_t i = 0; i < size(); i++) {
+		const Sample& sample = ring_[i];
+		stringstream str;
+		str << "root" << hex << setfill('0');
+		for (int n = 0; n < sample.depth; n++)
+			str << ";0x" << setw(4) << sample.stack[n];
+		str << ";0x" << setw(4) << sample.pc;
+		if (sample.page)
+			str << "_" << setw(2) << (int)sample.page;
+		stacks[str.str()]++;
+	}
+	
+	for (auto& stack : stacks)
+		out << stack.first << " " << dec << stack.second << endl;
+}
+
+// Records the block starting at block if the sampling timer fired.
+void Z80Base::take_sample(uint16_t block)
+{
+	if (!SampleProfiler::due.exchange(false, memory_order_relaxed))
+		return;
+	
+	uint8_t op = peek(block);
+	uint8_t page = op == EXT_DD || op == EXT_ED || op == EXT_FD ? op : 0;
+	sampler_->record(block, page, profiler_.get());
+}
+
+void *Z80Base::operator new(size_t size)
+{
+	void *ptr;
+	if (posix_memalign(&ptr, alignof(Registers), size))
+		throw bad_alloc();
+	
+	return ptr;
+}
+
+string Z80Base::disassemble(uint16_t addr)
+{
+	uint16_t pc = r_.pc;
+	r_.pc = addr;
+	string str = pc_str();
+	r_.pc = pc;
+	
+	return str;
+}
+
+void Z80Base::reset()
+{
+	r_ = Registers();
+	cycles_ = 0;
+	idle_cycles_ = 0;
+	if (flat_) {
+		flat_->fill(0);
+	} else {
+		for (int page = 0; page < PAGE_COUNT; page++)
+			unmap(page);
+	}
+	drop_checkpoint();
+	ports_.fill(0);
+	stop_ = STOP_NONE;
+}
+
+void Z80Base::save(Snapshot& snap) const
+{
+	snap.regs = r_;
+	snap.cycles = cycles_;
+	if (flat_)
+		snap.ram = *flat_;
+	else
+		read_mem(0, snap.ram.data(), MEM_SIZE);
+	snap.ports = ports_;
+}
+
+// Compact cores keep their ROM mappings and map all-zero pages to the
+// zero page rather than allocating them.
+void Z80Base::restore(const Snapshot& snap)
+{
+	r_ = snap.regs;
+	cycles_ = snap.cycles;
+	if (flat_) {
+		*flat_ = snap.ram;
+	} else {
+		for (int page = 0; page < PAGE_COUNT; page++) {
+			if (page_flags_[page] & PAGE_ROM)
+				continue;
+			
+			const uint8_t *src = &snap.ram[page << PAGE_BITS];
+			if (!src[0] && !memcmp(src, src + 1, PAGE_SIZE - 1)) {
+				unmap(page);
+			} else {
+				unshare(page);
+				memcpy(pages_[page], src, PAGE_SIZE);
+			}
+		}
+	}
+	ports_ = snap.ports;
+	stop_ = STOP_NONE;
+}
+
+Z80Base::~Z80Base()
+{
+	if (arena_)
+		for (int page = 0; page < PAGE_COUNT; page++)
+			unmap(page);
+	drop_checkpoint();
+}
+
+struct Z80Base::Checkpoint {
+	Registers regs;
+	uint64_t cycles;
+	array<uint8_t, 256> ports;
+	
+	// compact cores: the baseline page table, and which of its pages
+	// the core owns; flat cores: a copy of memory
+	uint8_t *pages[PAGE_COUNT] = {};
+	uint8_t flags[PAGE_COUNT] = {};
+	uint64_t owned = 0;
+	unique_ptr<array<uint8_t, MEM_SIZE>> ram;
+	
+	static void *operator new(size_t size) { return Z80Base::operator new(size); }
+	static void operator delete(void *ptr) { Z80Base::operator delete(ptr); }
+};
+
+void Z80Base::checkpoint()
+{
+	if (!checkpoint_)
+		checkpoint_.reset(new Checkpoint());
+	
+	Checkpoint& cp = *checkpoint_;
+	cp.regs = r_;
+	cp.cycles = cycles_;
+	cp.ports = ports_;
+	
+	if (flat_) {
+		if (!cp.ram)
+			cp.ram.reset(new array<uint8_t, MEM_SIZE>(*flat_));
+		else
+			*cp.ram = *flat_;
+		return;
+	}
+	
+	// private pages join the baseline as shared pages; baseline pages
+	// replaced since the last checkpoint are freed
+	uint64_t owned = 0;
+	for (int page = 0; page < PAGE_COUNT; page++) {
+		uint64_t bit = 1ull << page;
+		bool kept = pages_[page] == cp.pages[page];
+		
+		if ((cp.owned & bit) && !kept)
+			arena_->free(cp.pages[page]);
+		if (!(page_flags_[page] & PAGE_SHARED)) {
+			page_flags_[page] |= PAGE_SHARED;
+			owned |= bit;
+		} else if (kept) {
+			owned |= cp.owned & bit;
+		}
+		
+		cp.pages[page] = pages_[page];
+		cp.flags[page] = page_flags_[page] & (PAGE_ROM | PAGE_SHARED);
+	}
+	cp.owned = owned;
+}
+
+// Returns false if there is no checkpoint.
+bool Z80Base::rollback()
+{
+	if (!checkpoint_)
+		return false;
+	
+	const Checkpoint& cp = *checkpoint_;
+	r_ = cp.regs;
+	cycles_ = cp.cycles;
+	ports_ = cp.ports;
+	stop_ = STOP_NONE;
+	
+	if (flat_) {
+		*flat_ = *cp.ram;
+		return true;
+	}
+	
+	for (int page = 0; page < PAGE_COUNT; page++) {
+		if (pages_[page] != cp.pages[page]) {
+			if (!(page_flags_[page] & PAGE_SHARED))
+				arena_->free(pages_[page]);
+			pages_[page] = cp.pages[page];
+		}
+		page_flags_[page] = (page_flags_[page] & ~(PAGE_ROM | PAGE_SHARED)) | cp.flags[page];
+	}
+	
+	return true;
+}
+
+// Frees the baseline pages of a compact core, which must no longer be
+// mapped.
+void Z80Base::drop_checkpoint()
+{
+	if (!checkpoint_)
+		return;
+	
+	for (int page = 0; page < PAGE_COUNT; page++)
+		if (checkpoint_->owned & (1ull << page))
+			arena_->free(checkpoint_->pages[page]);
+	checkpoint_.reset();
+}
+
+void Z80Base::init_memory(array<uint8_t, MEM_SIZE> *flat, PageArena *arena)
+{
+	flat_ = flat;
+	arena_ = arena;
+	
+	for (int page = 0; page < PAGE_COUNT; page++) {
+		if (flat) {
+			pages_[page] = &(*flat)[page << PAGE_BITS];
+		} else {
+			pages_[page] = PageArena::zero_page();
+			page_flags_[page] |= PAGE_SHARED;
+		}
+	}
+	if (flat)
+		flat->fill(0);
+}
+
+// Gives a compact core a private copy of a shared page.
+void Z80Base::unshare(int page)
+{
+	if (!(page_flags_[page] & PAGE_SHARED))
+		return;
+	
+	uint8_t *copy = arena_->alloc();
+	memcpy(copy, pages_[page], PAGE_SIZE);
+	pages_[page] = copy;
+	page_flags_[page] &= ~PAGE_SHARED;
+}
+
+// Returns a compact core's page to the arena and maps the zero page.
+void Z80Base::unmap(int page)
+{
+	if (!(page_flags_[page] & PAGE_SHARED))
+		arena_->free(pages_[page]);
+	
+	pages_[page] = PageArena::zero_page();
+	page_flags_[page] = (page_flags_[page] & ~PAGE_ROM) | PAGE_SHARED;
+}
+
+void Z80Base::poke(uint16_t addr, uint8_t val)
+{
+	unshare(addr >> PAGE_BITS);
+	pages_[addr >> PAGE_BITS][addr & (PAGE_SIZE - 1)] = val;
+}
+
+void Z80Base::read_mem(uint16_t addr, uint8_t *buf, size_t len) const
+{
+	while (len) {
+		size_t offset = addr & (PAGE_SIZE - 1);
+		size_t n = min(len, PAGE_SIZE - offset);
+		memcpy(buf, &pages_[addr >> PAGE_BITS][offset], n);
+		addr += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+void Z80Base::write_mem(uint16_t addr, const uint8_t *data, size_t len)
+{
+	while (len) {
+		size_t offset = addr & (PAGE_SIZE - 1);
+		size_t n = min(len, PAGE_SIZE - offset);
+		unshare(addr >> PAGE_BITS);
+		memcpy(&pages_[addr >> PAGE_BITS][offset], data, n);
+		addr += n;
+		data += n;
+		len -= n;
+	}
+}
+
+bool Z80Base::map_rom(uint16_t addr, const RomImage& rom)
+{
+	if (addr & (PAGE_SIZE - 1) || addr + rom.size() > MEM_SIZE)
+		return false;
+	
+	for (size_t n = 0; n < rom.pages(); n++) {
+		int page = (addr >> PAGE_BITS) + (int)n;
+		if (flat_) {
+			memcpy(pages_[page], rom.page(n), PAGE_SIZE);
+		} else {
+			unmap(page);
+			pages_[page] = rom.page(n);
+			page_flags_[page] |= PAGE_ROM;
+		}
+	}
+	
+	return true;
+}
+
+size_t Z80Base::private_pages() const
+{
+	size_t n = 0;
+	
+	if (!flat_)
+		for (int page = 0; page < PAGE_COUNT; page++)
+			if (!(page_flags_[page] & PAGE_SHARED))
+				n++;
+	
+	return n;
+}
+
+CallProfiler& Z80Base::enable_profiler()
+{
+	if (!profiler_)
+		profiler_.reset(new CallProfiler(cycles_));
+	
+	return *profiler_;
+}
+
+AccessProfiler& Z80Base::enable_access_profiler(uint64_t window)
+{
+	if (!access_)
+		access_.reset(new AccessProfiler(cycles_, window));
+	
+	return *access_;
+}
+
+void Z80Base::add_breakpoint(uint16_t addr, const Condition& cond)
+{
+	breakpoints_[addr] = cond;
+	update_page_flags();
+}
+
+void Z80Base::remove_breakpoint(uint16_t addr)
+{
+	breakpoints_.erase(addr);
+	update_page_flags();
+}
+
+void Z80Base::add_watchpoint(uint16_t addr, uint32_t len, uint8_t kinds, const Condition& cond)
+{
+	watchpoints_.push_back(Watchpoint { addr, len, kinds, cond });
+	update_page_flags();
+}
+
+void Z80Base::remove_watchpoints(uint16_t addr, uint32_t len)
+{
+	watchpoints_.erase(remove_if(watchpoints_.begin(), watchpoints_.end(),
+		[addr, len](const Watchpoint& w) {
+			return w.addr < addr + len && addr < w.addr + w.len;
+		}), watchpoints_.end());
+	update_page_flags();
+}
+
+void Z80Base::illegal(uint16_t addr)
+{
+	stop_ = STOP_ILLEGAL;
+	stop_addr_ = addr;
+	
+	if (error_fn_)
+		error_fn_(error_ctx_, stop_, addr);
+}
+
+void Z80Base::update_page_flags()
+{
+	for (auto& flags : page_flags_)
+		flags &= PAGE_ROM | PAGE_SHARED;
+	
+	for (auto& bp : breakpoints_)
+		page_flags_[bp.first >> PAGE_BITS] |= PAGE_BREAK;
+	
+	for (auto& w : watchpoints_) {
+		uint8_t flags = 0;
+		if (w.kinds & WATCH_READ) flags |= PAGE_WATCH_READ;
+		if (w.kinds & WATCH_WRITE) flags |= PAGE_WATCH_WRITE;
+		
+		uint32_t end = min<uint32_t>(w.addr + w.len, MEM_SIZE);
+		for (uint32_t page = w.addr >> PAGE_BITS; page << PAGE_BITS < end; page++)
+			page_flags_[page] |= flags;
+	}
+}
+
+uint8_t Z80Base::read_watched(uint16_t addr)
+{
+	uint8_t val = peek(addr);
+	check_watchpoints(addr, WATCH_READ, val);
+	return val;
+}
+
+// Writes to watched pages and, on compact cores, to ROM and shared pages.
+// A watched write to ROM still stops the CPU although it has no effect.
+void Z80Base::write_slow(uint16_t addr, uint8_t val, bool watch)
+{
+	int page = addr >> PAGE_BITS;
+	
+	if (watch && (page_flags_[page] & PAGE_WATCH_WRITE))
+		check_watchpoints(addr, WATCH_WRITE, val);
+	if (page_flags_[page] & PAGE_ROM)
+		return;
+	
+	unshare(page);
+	pages_[page][addr & (PAGE_SIZE - 1)] = val;
+}
+
+// Length of an instruction allowed in the body of a polling loop: one
+// that doesn't write memory, ports or the stack and doesn't branch, so a
+// pass only depends on the registers it starts with. 0 for others.
+static int idle_length(const uint8_t *code)
+{
+	switch (code[0]) {
+		case NOOP: case EX_AF_AF2: case EXX:
+		case INC_BC: case INC_DE: case INC_HL: case INC_SP:
+		case DEC_BC: case DEC_DE: case DEC_HL: case DEC_SP:
+		case INC_A: case INC_B: case INC_C: case INC_D: case INC_E: case INC_F: case INC_L:
+		case DEC_A: case DEC_B: case DEC_C: case DEC_D: case DEC_E: case DEC_F: case DEC_L:
+		case ADD_HL_BC: case ADD_HL_DE: case ADD_HL_HL: case ADD_HL_SP:
+		case LD_A_ind_BC: case LD_A_ind_DE:
+			return 1;
+		case ADD_A_imm: case ADC_A_imm: case SUB_A_imm: case SBC_A_imm:
+		case AND_A_imm: case XOR_A_imm: case OR_A_imm: case CP_imm:
+			return 2;
+		case EXT_FD:
+			return code[1] == FD_LD_A_ext ? 4 : 0;
+	}
+	
+	// register and (hl) loads and ALU ops, except loads into (hl)
+	if ((code[0] >= LD_B_B && code[0] <= LD_L_A) || (code[0] >= LD_A_B && code[0] <= CP_A))
+		return 1;
+	return 0;
+}
+
+static int idle_op_cycles(const uint8_t *code)
+{
+	return code[0] == EXT_FD ? CYCLES[EXT_FD] + CYCLES_IDX[code[1]] : CYCLES[code[0]];
+}
+
+static uint8_t *dec_counter(Registers& r, uint8_t op)
+{
+	switch (op) {
+		case DEC_A: return &r.a;
+		case DEC_B: return &r.b;
+		case DEC_C: return &r.c;
+		case DEC_D: return &r.d;
+		case DEC_E: return &r.e;
+		case DEC_L: return &r.l;
+		default: return nullptr;
+	}
+}
+
+static uint16_t *dec16_counter(Registers& r, const uint8_t *code)
+{
+	if (code[0] == DEC_BC && ((code[1] == LD_A_B && code[2] == OR_A_C) ||
+			(code[1] == LD_A_C && code[2] == OR_A_B)))
+		return &r.bc;
+	if (code[0] == DEC_DE && ((code[1] == LD_A_D && code[2] == OR_A_E) ||
+			(code[1] == LD_A_E && code[2] == OR_A_D)))
+		return &r.de;
+	return nullptr;
+}
+
+// Called by the run loops after a relative branch at branch jumped back to
+// PC. Countdown loops (DJNZ to itself, DEC r / JR NZ and DEC rr / LD A,hi /
+// OR lo / JR NZ) have their counter advanced directly. Polling loops whose
+// registers come back the same after a pass can't ever exit, since nothing
+// else writes memory while running, and are skipped to the end of the run.
+//
+// Only whole passes that end by end are skipped, leaving the last pass
+// of a countdown to step() so A and F are set. now and end count cycles,
+// or instructions when cycles is false; end is ~0 if the run is open
+// ended. Returns the number skipped.
+uint64_t Z80Base::idle_skip(uint16_t branch, uint64_t now, uint64_t end, bool cycles, bool watch)
+{
+	uint16_t head = r_.pc;
+	int span = branch - head;
+	
+	if (head == idle_miss_ || span > IDLE_SPAN || now >= end || access_)
+		return 0;
+	if (watch && (!watchpoints_.empty() ||
+			((page_flags_[head >> PAGE_BITS] | page_flags_[branch >> PAGE_BITS]) & PAGE_BREAK)))
+		return 0;
+	
+	uint8_t code[IDLE_SPAN + 2];
+	read_mem(head, code, span + 2);
+	
+	uint8_t br = code[span];
+	if (br != DJNZ && br != JR && br != JR_NZ && br != JR_Z && br != JR_NC && br != JR_C)
+		return 0;
+	
+	uint64_t per = CYCLES[br] + (br == JR ? 0 : 5);
+	uint64_t insns = 1;
+	uint8_t *count8 = nullptr;
+	uint16_t *count16 = nullptr;
+	
+	if (br == DJNZ && span == 0)
+		count8 = &r_.b;
+	else if (br == JR_NZ && span == 1)
+		count8 = dec_counter(r_, code[0]);
+	else if (br == JR_NZ && span == 3)
+		count16 = dec16_counter(r_, code);
+	
+	if (count8 || count16) {
+		for (int n = 0; n < span; n++, insns++)
+			per += CYCLES[code[n]];
+		
+		uint64_t unit = cycles ? per : insns;
+		uint64_t left = count8 ? (*count8 ? *count8 : 0x100) - 1 : (*count16 ? *count16 : 0x10000) - 1;
+		uint64_t passes = min(left, (end - now) / unit);
+		if (passes < 2)
+			return 0;
+		
+		passes--;
+		if (count8)
+			*count8 -= (uint8_t)passes;
+		else
+			*count16 -= (uint16_t)passes;
+		
+		idle_cycles_ += passes * unit;
+		if (cycles)
+			cycles_ += passes * unit;
+		return passes * unit;
+	}
+	
+	int n = 0;
+	while (n < span) {
+		int len = idle_length(&code[n]);
+		if (!len)
+			break;
+		per += idle_op_cycles(&code[n]);
+		insns++;
+		n += len;
+	}
+	if (br == DJNZ || n != span) {
+		idle_miss_ = head;
+		return 0;
+	}
+	
+	// compare with the previous pass, if this directly follows it
+	uint64_t unit = cycles ? per : insns;
+	if (head != idle_head_ || now - idle_mark_ != unit) {
+		idle_tries_ = 0;
+	} else if (memcmp(&r_, &idle_regs_, sizeof r_)) {
+		if (++idle_tries_ >= IDLE_TRIES)
+			idle_miss_ = head;
+	} else if (end != ~0ull) {
+		uint64_t skipped = (end - now) / unit * unit;
+		idle_cycles_ += skipped;
+		if (cycles)
+			cycles_ += skipped;
+		idle_mark_ = now + skipped;
+		return skipped;
+	}
+	
+	idle_head_ = head;
+	idle_mark_ = now;
+	idle_regs_ = r_;
+	return 0;
+}
+
+void Z80Base::check_watchpoints(uint16_t addr, uint8_t kind, uint8_t val)
+{
+	for (auto& w : watchpoints_) {
+		if ((w.kinds & kind) && (uint32_t)(addr - w.addr) < w.len && test(w.cond, val)) {
+			stop_ = kind == WATCH_READ ? STOP_WATCH_READ : STOP_WATCH_WRITE;
+			stop_addr_ = addr;
+		}
+	}
+}
+
+bool Z80Base::check_breakpoint()
+{
+	auto it = breakpoints_.find(r_.pc);
+	return it != breakpoints_.end() && test(it->second);
+}
+
+uint16_t Z80Base::reg_value(uint8_t reg) const
+{
+	switch (reg) {
+		case Condition::R_A: return r_.a;
+		case Condition::R_F: return r_.f;
+		case Condition::R_B: return r_.b;
+		case Condition::R_C: return r_.c;
+		case Condition::R_D: return r_.d;
+		case Condition::R_E: return r_.e;
+		case Condition::R_H: return r_.h;
+		case Condition::R_L: return r_.l;
+		case Condition::R_AF: return r_.af;
+		case Condition::R_BC: return r_.bc;
+		case Condition::R_DE: return r_.de;
+		case Condition::R_HL: return r_.hl;
+		case Condition::R_IX: return r_.ix;
+		case Condition::R_IY: return r_.iy;
+		case Condition::R_SP: return r_.sp;
+		case Condition::R_PC: return r_.pc;
+		case Condition::R_I: return r_.i;
+		case Condition::R_R: return r_.r;
+		default: return 0;
+	}
+}
+
+// Evaluates compiled condition bytecode. Condition::compile() guarantees
+// the stack stays within MAX_DEPTH, so there are no checks here.
+bool Z80Base::test(const Condition& cond, uint8_t val) const
+{
+	uint32_t stack[Condition::MAX_DEPTH];
+	int sp = 0;
+	
+	const uint8_t *pc = cond.code().data();
+	const uint8_t *end = pc + cond.code().size();
+	
+	while (pc < end) {
+		uint8_t op = *pc++;
+		
+		if (op >= Condition::C_ADD) {
+			uint32_t b = stack[--sp];
+			uint32_t& a = stack[sp - 1];
+			
+			switch (op) {
+				case Condition::C_ADD: a = a + b; break;
+				case Condition::C_SUB: a = a - b; break;
+				case Condition::C_AND: a = a & b; break;
+				case Condition::C_XOR: a = a ^ b; break;
+				case Condition::C_OR: a = a | b; break;
+				case Condition::C_EQ: a = a == b; break;
+				case Condition::C_NE: a = a != b; break;
+				case Condition::C_LT: a = a < b; break;
+				case Condition::C_LE: a = a <= b; break;
+				case Condition::C_GT: a = a > b; break;
+				case Condition::C_GE: a = a >= b; break;
+				case Condition::C_LAND: a = a && b; break;
+				case Condition::C_LOR: a = a || b; break;
+			}
+			continue;
+		}
+		
+		switch (op) {
+			case Condition::C_CONST: stack[sp++] = pc[0] << 8 | pc[1]; pc += 2; break;
+			case Condition::C_REG: stack[sp++] = reg_value(*pc++); break;
+			case Condition::C_VAL: stack[sp++] = val; break;
+			case Condition::C_MEM: stack[sp - 1] = peek((uint16_t)stack[sp - 1]); break;
+			case Condition::C_NOT: stack[sp - 1] = !stack[sp - 1]; break;
+			case Condition::C_BNOT: stack[sp - 1] = ~stack[sp - 1]; break;
+		}
+	}
+	
+	return !sp || stack[0];
+}
+
+template <class Policy>
+void Z80Core<Policy>::op_call(uint16_t addr)
+{
+	push(r_.pc);
+	r_.pc = addr;
+	
+	if (Policy::profile && profiler_)
+		profiler_->call(addr, r_.sp, cycles_);
+}
+
+template <class Policy>
+void Z80Core<Policy>::op_ret()
+{
+	if (Policy::profile && profiler_)
+		profiler_->ret(r_.sp, cycles_);
+	
+	r_.pc = pop();
+}
+
+// Appends to a buffer with room for the text, without allocating. Hex
+// values are written through hex2(), hex4() and, unpadded, hexn().
+struct Hex {
+	unsigned val;
+	int width;
+};
+
+static Hex hex2(unsigned val) { return Hex { val, 2 }; }
+static Hex hex4(unsigned val) { return Hex { val, 4 }; }
+static Hex hexn(unsigned val) { return Hex { val, 0 }; }
+
+struct TextOut {
+	char *p;
+	
+	TextOut& operator<<(const char *str)
+	{
+		while (*str)
+			*p++ = *str++;
+		return *this;
+	}
+	
+	TextOut& operator<<(char c)
+	{
+		*p++ = c;
+		return *this;
+	}
+	
+	TextOut& operator<<(Hex hex)
+	{
+		static const char DIGITS[] = "0123456789abcdef";
+		
+		if (hex.width == 4) {
+			byte(hex.val >> 8);
+			byte(hex.val);
+		} else if (hex.width == 2) {
+			byte(hex.val);
+		} else {
+			int width = 1;
+			while (width < 8 && hex.val >> (4 * width))
+				width++;
+			for (int n = width - 1; n >= 0; n--)
+				*p++ = DIGITS[(hex.val >> (4 * n)) & 15];
+		}
+		return *this;
+	}
+	
+	void byte(unsigned val)
+	{
+		memcpy(p, &HEX_PAIRS[2 * (val & 0xFF)], 2);
+		p += 2;
+	}
+	
+	static const char HEX_PAIRS[513];
+};
+
+const char TextOut::HEX_PAIRS[513] =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+string Z80Base::pc_str()
+{
+	char buf[INSN_TEXT_MAX];
+	return string(buf, format_insn(buf));
+}
+
+char *Z80Base::format_insn(char *out)
+{
+	uint16_t old_pc = r_.pc;
+	uint8_t code;
+	TextOut str { out };
+	
+	switch (code = next()) {
+		case NOOP: str << "noop"; break;
+		case LD_A_A: str << "ld a, a"; break;
+		case LD_A_B: str << "ld a, b"; break;
+		case LD_A_C: str << "ld a, c"; break;
+		case LD_A_D: str << "ld a, d"; break;
+		case LD_A_E: str << "ld a, e"; break;
+		case LD_A_F: str << "ld a, f"; break;
+		case LD_A_L: str << "ld a, l"; break;
+		case LD_B_A: str << "ld b, a"; break;
+		case LD_B_B: str << "ld b, b"; break;
+		case LD_B_C: str << "ld b, c"; break;
+		case LD_B_D: str << "ld b, d"; break;
+		case LD_B_E: str << "ld b, e"; break;
+		case LD_B_F: str << "ld b, f"; break;
+		case LD_B_L: str << "ld b, l"; break;
+		case LD_C_A: str << "ld c, a"; break;
+		case LD_C_B: str << "ld c, b"; break;
+		case LD_C_C: str << "ld c, c"; break;
+		case LD_C_D: str << "ld c, d"; break;
+		case LD_C_E: str << "ld c, e"; break;
+		case LD_C_F: str << "ld c, f"; break;
+		case LD_C_L: str << "ld c, l"; break;
+		case LD_D_A: str << "ld d, a"; break;
+		case LD_D_B: str << "ld d, b"; break;
+		case LD_D_C: str << "ld d, c"; break;
+		case LD_D_D: str << "ld d, d"; break;
+		case LD_D_E: str << "ld d, e"; break;
+		case LD_D_F: str << "ld d, f"; break;
+		case LD_D_L: str << "ld d, l"; break;
+		case LD_E_A: str << "ld e, a"; break;
+		case LD_E_B: str << "ld e, b"; break;
+		case LD_E_C: str << "ld e, c"; break;
+		case LD_E_D: str << "ld e, d"; break;
+		case LD_E_E: str << "ld e, e"; break;
+		case LD_E_F: str << "ld e, f"; break;
+		case LD_E_L: str << "ld e, l"; break;
+		case LD_H_A: str << "ld h, a"; break;
+		case LD_H_B: str << "ld h, b"; break;
+		case LD_H_C: str << "ld h, c"; break;
+		case LD_H_D: str << "ld h, d"; break;
+		case LD_H_E: str << "ld h, e"; break;
+		case LD_H_F: str << "ld h, f"; break;
+		case LD_H_L: str << "ld h, l"; break;
+		case LD_L_A: str << "ld l, a"; break;
+		case LD_L_B: str << "ld l, b"; break;
+		case LD_L_C: str << "ld l, c"; break;
+		case LD_L_D: str << "ld l, d"; break;
+		case LD_L_E: str << "ld l, e"; break;
+		case LD_L_F: str << "ld l, f"; break;
+		case LD_L_L: str << "ld l, l"; break;
+		case LD_A_ind_HL: str << "ld a, (hl)"; break;
+		case LD_A_ind_BC: str << "ld a, (bc)"; break;
+		case LD_A_ind_DE: str << "ld a, (de)"; break;
+		case LD_B_ind_HL: str << "ld b, (hl)"; break;
+		case LD_C_ind_HL: str << "ld c, (hl)"; break;
+		case LD_D_ind_HL: str << "ld d, (hl)"; break;
+		case LD_E_ind_HL: str << "ld e, (hl)"; break;
+		case LD_H_ind_HL: str << "ld h, (hl)"; break;
+		case LD_L_ind_HL: str << "ld l, (hl)"; break;
+		case LD_ind_HL_A: str << "ld (hl), a"; break;
+		case LD_ind_HL_B: str << "ld (hl), b"; break;
+		case LD_ind_HL_C: str << "ld (hl), c"; break;
+		case LD_ind_HL_D: str << "ld (hl), d"; break;
+		case LD_ind_HL_E: str << "ld (hl), e"; break;
+		case LD_ind_HL_F: str << "ld (hl), f"; break;
+		case LD_ind_HL_L: str << "ld (hl), l"; break;
+		case LD_ind_BC_A: str << "ld (bc), a"; break;
+		case LD_ind_DE_A: str << "ld (de), a"; break;
+		case LD_ext_A: str << "ld (0x" << hex4(next16()) << "), a"; break;
+		case ADD_A_A: str << "add a, a"; break;
+		case ADD_A_B: str << "add a, b"; break;
+		case ADD_A_C: str << "add a, c"; break;
+		case ADD_A_D: str << "add a, d"; break;
+		case ADD_A_E: str << "add a, e"; break;
+		case ADD_A_F: str << "add a, f"; break;
+		case ADD_A_L: str << "add a, l"; break;
+		case ADD_A_ind_HL: str << "add a, (hl)"; break;
+		case ADD_A_imm: str << "add a, 0x" << hex2(next()); break;
+		case ADC_A_A: str << "adc a, a"; break;
+		case ADC_A_B: str << "adc a, b"; break;
+		case ADC_A_C: str << "adc a, c"; break;
+		case ADC_A_D: str << "adc a, d"; break;
+		case ADC_A_E: str << "adc a, e"; break;
+		case ADC_A_F: str << "adc a, f"; break;
+		case ADC_A_L: str << "adc a, l"; break;
+		case ADC_A_ind_HL: str << "adc a, (hl)"; break;
+		case ADC_A_imm: str << "adc a, 0x" << hex2(next()); break;
+		case SUB_A_A: str << "sub a, a"; break;
+		case SUB_A_B: str << "sub a, b"; break;
+		case SUB_A_C: str << "sub a, c"; break;
+		case SUB_A_D: str << "sub a, d"; break;
+		case SUB_A_E: str << "sub a, e"; break;
+		case SUB_A_F: str << "sub a, f"; break;
+		case SUB_A_L: str << "sub a, l"; break;
+		case SUB_A_ind_HL: str << "sub a, (hl)"; break;
+		case SUB_A_imm: str << "sub a, 0x" << hex2(next()); break;
+		case SBC_A_A: str << "sbc a, a"; break;
+		case SBC_A_B: str << "sbc a, b"; break;
+		case SBC_A_C: str << "sbc a, c"; break;
+		case SBC_A_D: str << "sbc a, d"; break;
+		case SBC_A_E: str << "sbc a, e"; break;
+		case SBC_A_F: str << "sbc a, f"; break;
+		case SBC_A_L: str << "sbc a, l"; break;
+		case SBC_A_ind_HL: str << "sbc a, (hl)"; break;
+		case SBC_A_imm: str << "sbc a, 0x" << hex2(next()); break;
+		case AND_A_A: str << "and a, a"; break;
+		case AND_A_B: str << "and a, b"; break;
+		case AND_A_C: str << "and a, c"; break;
+		case AND_A_D: str << "and a, d"; break;
+		case AND_A_E: str << "and a, e"; break;
+		case AND_A_F: str << "and a, f"; break;
+		case AND_A_L: str << "and a, l"; break;
+		case AND_A_ind_HL: str << "and a, (hl)"; break;
+		case AND_A_imm: str << "and a, 0x" << hex2(next()); break;
+		case XOR_A_A: str << "xor a, a"; break;
+		case XOR_A_B: str << "xor a, b"; break;
+		case XOR_A_C: str << "xor a, c"; break;
+		case XOR_A_D: str << "xor a, d"; break;
+		case XOR_A_E: str << "xor a, e"; break;
+		case XOR_A_F: str << "xor a, f"; break;
+		case XOR_A_L: str << "xor a, l"; break;
+		case XOR_A_ind_HL: str << "xor a, (hl)"; break;
+		case XOR_A_imm: str << "xor a, 0x" << hex2(next()); break;
+		case OR_A_A: str << "or a, a"; break;
+		case OR_A_B: str << "or a, b"; break;
+		case OR_A_C: str << "or a, c"; break;
+		case OR_A_D: str << "or a, d"; break;
+		case OR_A_E: str << "or a, e"; break;
+		case OR_A_F: str << "or a, f"; break;
+		case OR_A_L: str << "or a, l"; break;
+		case OR_A_ind_HL: str << "or a, (hl)"; break;
+		case OR_A_imm: str << "or a, 0x" << hex2(next()); break;
+		case CP_A: str << "cp a"; break;
+		case CP_B: str << "cp b"; break;
+		case CP_C: str << "cp c"; break;
+		case CP_D: str << "cp d"; break;
+		case CP_E: str << "cp e"; break;
+		case CP_F: str << "cp f"; break;
+		case CP_L: str << "cp l"; break;
+		case CP_ind_HL: str << "cp (hl)"; break;
+		case CP_imm: str << "cp 0x" << hex2(next()); break;
+		case INC_A: str << "inc a"; break;
+		case INC_B: str << "inc b"; break;
+		case INC_C: str << "inc c"; break;
+		case INC_D: str << "inc d"; break;
+		case INC_E: str << "inc e"; break;
+		case INC_F: str << "inc f"; break;
+		case INC_L: str << "inc l"; break;
+		case INC_ind_HL: str << "inc (hl)"; break;
+		case DEC_A: str << "dec a"; break;
+		case DEC_B: str << "dec b"; break;
+		case DEC_C: str << "dec c"; break;
+		case DEC_D: str << "dec d"; break;
+		case DEC_E: str << "dec e"; break;
+		case DEC_F: str << "dec f"; break;
+		case DEC_L: str << "dec l"; break;
+		case DEC_ind_HL: str << "dec (hl)"; break;
+		case JP: str << "jp 0x" << hex4(next16()); break;
+		case JP_C: str << "jp c, 0x" << hex4(next16()); break;
+		case JP_NC: str << "jp nc, 0x" << hex4(next16()); break;
+		case JP_Z: str << "jp z, 0x" << hex4(next16()); break;
+		case JP_NZ: str << "jp nz, 0x" << hex4(next16()); break;
+		case JP_PO: str << "jp po, 0x" << hex4(next16()); break;
+		case JP_PE: str << "jp pe, 0x" << hex4(next16()); break;
+		case JP_M: str << "jp m, 0x" << hex4(next16()); break;
+		case JP_P: str << "jp p, 0x" << hex4(next16()); break;
+		case JP_ind_HL: str << "jp (hl)"; break;
+		case JR: str << "jr 0x" << hex2(next()); break;
+		case JR_C: str << "jr c, 0x" << hex2(next()); break;
+		case JR_NC: str << "jr nc, 0x" << hex2(next()); break;
+		case JR_Z: str << "jr z, 0x" << hex2(next()); break;
+		case JR_NZ: str << "jr nz, 0x" << hex2(next()); break;
+		case DJNZ: str << "djnz 0x" << hex2(next()); break;
+		case INC_BC: str << "inc bc"; break;
+		case INC_DE: str << "inc de"; break;
+		case INC_HL: str << "inc hl"; break;
+		case INC_SP: str << "inc sp"; break;
+		case DEC_BC: str << "dec bc"; break;
+		case DEC_DE: str << "dec de"; break;
+		case DEC_HL: str << "dec hl"; break;
+		case DEC_SP: str << "dec sp"; break;
+		case ADD_HL_BC: str << "add hl, bc"; break;
+		case ADD_HL_DE: str << "add hl, de"; break;
+		case ADD_HL_HL: str << "add hl, hl"; break;
+		case ADD_HL_SP: str << "add hl, sp"; break;
+		case EX_AF_AF2: str << "ex af, af'"; break;
+		case EXX: str << "exx"; break;
+		case LD_BC_imm: str << "ld bc, 0x" << hex4(next16()); break;
+		case LD_DE_imm: str << "ld de, 0x" << hex4(next16()); break;
+		case LD_HL_imm: str << "ld hl, 0x" << hex4(next16()); break;
+		case LD_SP_imm: str << "ld sp, 0x" << hex4(next16()); break;
+		case PUSH_AF: str << "push af"; break;
+		case PUSH_BC: str << "push bc"; break;
+		case PUSH_DE: str << "push de"; break;
+		case PUSH_HL: str << "push hl"; break;
+		case POP_AF: str << "pop af"; break;
+		case POP_BC: str << "pop bc"; break;
+		case POP_DE: str << "pop de"; break;
+		case POP_HL: str << "pop hl"; break;
+		case CALL: str << "call 0x" << hex4(next16()); break;
+		case CALL_C: str << "call c, 0x" << hex4(next16()); break;
+		case CALL_NC: str << "call nc, 0x" << hex4(next16()); break;
+		case CALL_Z: str << "call z, 0x" << hex4(next16()); break;
+		case CALL_NZ: str << "call nz, 0x" << hex4(next16()); break;
+		case CALL_PO: str << "call po, 0x" << hex4(next16()); break;
+		case CALL_PE: str << "call pe, 0x" << hex4(next16()); break;
+		case CALL_M: str << "call m, 0x" << hex4(next16()); break;
+		case CALL_P: str << "call p, 0x" << hex4(next16()); break;
+		case RET: str << "ret"; break;
+		case RET_C: str << "ret c"; break;
+		case RET_NC: str << "ret nc"; break;
+		case RET_Z: str << "ret z"; break;
+		case RET_NZ: str << "ret nz"; break;
+		case RET_PO: str << "ret po"; break;
+		case RET_PE: str << "ret pe"; break;
+		case RET_M: str << "ret m"; break;
+		case RET_P: str << "ret p"; break;
+			
+		case EXT_DD:
+			switch (code = next()) {
+				case DD_LD_B_imm: str << "ld b, 0x" << hex2(next()); break;
+				case DD_LD_C_imm: str << "ld c, 0x" << hex2(next()); break;
+				case DD_LD_D_imm: str << "ld d, 0x" << hex2(next()); break;
+				case DD_LD_E_imm: str << "ld e, 0x" << hex2(next()); break;
+				case DD_LD_H_imm: str << "ld h, 0x" << hex2(next()); break;
+				case DD_LD_A_idx_IY: str << "ld a, (iy + 0x" << hex2(next()) << ")"; break;
+				case DD_LD_B_idx_IX: str << "ld b, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_LD_C_idx_IX: str << "ld c, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_LD_D_idx_IX: str << "ld d, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_LD_E_idx_IX: str << "ld e, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_LD_H_idx_IX: str << "ld h, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_LD_L_idx_IX: str << "ld l, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_LD_idx_IX_A: str << "ld (ix + 0x" << hex2(next()) << "), a"; break;
+				case DD_LD_idx_IX_B: str << "ld (ix + 0x" << hex2(next()) << "), b"; break;
+				case DD_LD_idx_IX_C: str << "ld (ix + 0x" << hex2(next()) << "), c"; break;
+				case DD_LD_idx_IX_D: str << "ld (ix + 0x" << hex2(next()) << "), d"; break;
+				case DD_LD_idx_IX_E: str << "ld (ix + 0x" << hex2(next()) << "), e"; break;
+				case DD_LD_idx_IX_F: str << "ld (ix + 0x" << hex2(next()) << "), f"; break;
+				case DD_LD_idx_IX_L: str << "ld (ix + 0x" << hex2(next()) << "), l"; break;
+				case DD_INC_idx_IX: str << "inc (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_DEC_idx_IX: str << "dec (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_LD_idx_IX_imm: str << "ld (ix + 0x" << hex2(next()) << "), 0x" << hex2(next()); break;
+				case DD_LD_ind_HL_imm: str << "ld (hl), 0x" << hex2(next()); break;
+				case DD_ADD_A_idx_IX: str << "add a, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_ADC_A_idx_IX: str << "adc a, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_SUB_A_idx_IX: str << "sub a, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_SBC_A_idx_IX: str << "sbc a, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_AND_A_idx_IX: str << "and a, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_XOR_A_idx_IX: str << "xor a, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_OR_A_idx_IX: str << "or a, (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_CP_idx_IX: str << "cp (ix + 0x" << hex2(next()) << ")"; break;
+				case DD_JP_ind_IX: str << "jp (ix)"; break;
+				default: str << "0x" << hexn(0xDD00 & code); break;
+			}
+			break;
+			
+		case EXT_ED:
+			switch (code = next()) {
+				case ED_LD_imp_I_A: str << "ld i, a"; break;
+				case ED_LD_imp_R_A: str << "ld r, a"; break;
+				case ED_LDI: str << "ldi"; break;
+				case ED_LDIR: str << "ldir"; break;
+				case ED_LDD: str << "ldd"; break;
+				case ED_LDDR: str << "lddr"; break;
+				case ED_CPI: str << "cpi"; break;
+				case ED_CPIR: str << "cpir"; break;
+				case ED_INIR: str << "inir"; break;
+				case ED_OTIR: str << "otir"; break;
+				default: str << "0x" << hexn(0xED00 & code); break;
+			}
+			break;
+			
+		case EXT_FD:
+			switch (code = next()) {
+				case FD_LD_A_imm: str << "ld a, 0x" << hex2(next()); break;
+				case FD_LD_A_ext: str << "ld a, (0x" << hex4(next16()) << ")"; break;
+				case FD_LD_A_idx_IX: str << "ld a, (ix + 0x" << hex2(next()) << ")"; break;
+				case FD_LD_B_idx_IY: str << "ld b, (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_LD_C_idx_IY: str << "ld c, (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_LD_D_idx_IY: str << "ld d, (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_LD_E_idx_IY: str << "ld e, (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_LD_H_idx_IY: str << "ld h, (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_LD_idx_IY_A: str << "ld (iy + 0x" << hex2(next()) << "), a"; break;
+				case FD_LD_idx_IY_B: str << "ld (iy + 0x" << hex2(next()) << "), b"; break;
+				case FD_LD_idx_IY_C: str << "ld (iy + 0x" << hex2(next()) << "), c"; break;
+				case FD_LD_idx_IY_D: str << "ld (iy + 0x" << hex2(next()) << "), d"; break;
+				case FD_LD_idx_IY_E: str << "ld (iy + 0x" << hex2(next()) << "), e"; break;
+				case FD_LD_idx_IY_F: str << "ld (iy + 0x" << hex2(next()) << "), f"; break;
+				case FD_LD_idx_IY_L: str << "ld (iy + 0x" << hex2(next()) << "), l"; break;
+				case FD_INC_idx_IY: str << "inc (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_DEC_idx_IY: str << "dec (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_LD_idx_IY_imm: str << "ld (iy + 0x" << hex2(next()) << "), 0x" << hex2(next()); break;
+				case FD_ADD_A_idx_IY: str << "add a, (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_ADC_A_idx_IY: str << "adc a, (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_SUB_A_idx_IY: str << "sub a, (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_SBC_A_idx_IY: str << "sbc a, (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_AND_A_idx_IY: str << "and a, (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_XOR_A_idx_IY: str << "xor a, (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_OR_A_idx_IY: str << "or a, (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_CP_idx_IY: str << "cp (iy + 0x" << hex2(next()) << ")"; break;
+				case FD_JP_ind_IY: str << "jp (iy)"; break;
+				default: str << "0x" << hexn(0xFD00 & code); break;
+			}
+			break;
+			
+		default:
+			str << "0x" << hexn(code);
+			break;
+	}
+	
+	r_.pc = old_pc;
+	return str.p;
+}
+
+
+char *Z80Base::format_regs(char *out)
+{
+	TextOut str { out };
+	
+	str <<   "A: 0x"  << hex2(r_.a)  << "  F: 0x"  << hex2(r_.f)
+		<< "  A': 0x" << hex2(r_.a2) << "  F': 0x" << hex2(r_.f2) << '\n'
+		<<   "B: 0x"  << hex2(r_.b)  << "  C: 0x"  << hex2(r_.c)
+		<< "  B': 0x" << hex2(r_.b2) << "  C': 0x" << hex2(r_.c2) << '\n'
+		<<   "D: 0x"  << hex2(r_.d)  << "  E: 0x"  << hex2(r_.e)
+		<< "  D': 0x" << hex2(r_.d2) << "  E': 0x" << hex2(r_.e2) << '\n'
+		<<   "H: 0x"  << hex2(r_.h)  << "  L: 0x"  << hex2(r_.l)
+		<< "  H': 0x" << hex2(r_.h2) << "  L': 0x" << hex2(r_.l2) << '\n'
+		<< "I: 0x"  << hex2(r_.i)  << "  R: 0x"  << hex2(r_.r) << '\n'
+		<< "IX: 0x"  << hex4(r_.ix) << '\n'
+		<< "IY: 0x"  << hex4(r_.iy) << '\n'
+		<< "SP: 0x"  << hex4(r_.sp) << '\n'
+		<< "PC: 0x"  << hex4(r_.pc) << '\n'
+		<<    "S: " << hexn(fs())  << "  Z: " << hexn(fz()) << "  H: " << hexn(fh())
+		<< "  PV: " << hexn(fpv()) << "  N: " << hexn(fn()) << "  C: " << hexn(fc()) << '\n';
+	
+	return str.p;
+}
+
+void Z80Base::dump_regs(ostream& out)
+{
+	char buf[REGS_TEXT_MAX];
+	out.write(buf, format_regs(buf) - buf);
+}
+
+// One line per instruction: the address, the instruction and the
+// registers before it runs.
+char *Z80Base::format_line(char *out)
+{
+	TextOut str { out };
+	
+	str << hex4(r_.pc) << "  ";
+	char *insn = str.p;
+	str.p = format_insn(str.p);
+	while (str.p < insn + 20)
+		*str.p++ = ' ';
+	
+	str << " af=" << hex4(r_.af) << " bc=" << hex4(r_.bc) << " de=" << hex4(r_.de)
+		<< " hl=" << hex4(r_.hl) << " ix=" << hex4(r_.ix) << " iy=" << hex4(r_.iy)
+		<< " sp=" << hex4(r_.sp) << '\n';
+	
+	return str.p;
+}
+
+void Z80Base::trace_start()
+{
+	if (!trace_buf_)
+		trace_buf_.reset(new char[TRACE_BUF_SIZE]);
+	trace_end_ = trace_buf_.get();
+	trace_regs();
+}
+
+// Called before each instruction, writing out the buffer when the next
+// one might not fit.
+void Z80Base::trace_insn(ostream& out)
+{
+	char *buf = trace_buf_.get();
+	if (trace_end_ > buf + TRACE_BUF_SIZE - TRACE_STEP_MAX) {
+		out.write(buf, trace_end_ - buf);
+		trace_end_ = buf;
+	}
+	
+	if (trace_format_ == TRACE_LINES) {
+		trace_end_ = format_line(trace_end_);
+	} else {
+		TextOut str { trace_end_ };
+		str << "> ";
+		str.p = format_insn(str.p);
+		str << "\n\n";
+		trace_end_ = str.p;
+	}
+}
+
+void Z80Base::trace_regs()
+{
+	if (trace_format_ == TRACE_DUMP) {
+		trace_end_ = format_regs(trace_end_);
+		*trace_end_++ = '\n';
+	}
+}
+
+void Z80Base::trace_stop(ostream& out)
+{
+	TextOut str { trace_end_ };
+	
+	if (stop_ != STOP_NONE)
+		str << "* " << (stop_ == STOP_BREAKPOINT ? "breakpoint" :
+			stop_ == STOP_ILLEGAL ? "illegal opcode" : stop_ == STOP_LIMIT ? "limit" : "watchpoint")
+			<< " at 0x" << hex4(stop_addr_) << '\n';
+	else if (trace_format_ == TRACE_LINES)
+		str.p = format_line(str.p);
+	else
+		str << "> noop\n";
+	
+	out.write(trace_buf_.get(), str.p - trace_buf_.get());
+	out.flush();
+}
+
+template <class Policy>
+void Z80Core<Policy>::step()
+{
+	uint8_t tmp;
+	uint16_t tmp16;
+
+	uint8_t code = next();
+	tick(CYCLES[code]);
+	
+	switch (code) {
+		case NOOP: break;
+		case LD_A_A: break;
+		case LD_A_B: r_.a = r_.b; break;;
+		case LD_A_C: r_.a = r_.c; break;
+		case LD_A_D: r_.a = r_.d; break;
+		case LD_A_E: r_.a = r_.e; break;
+		case LD_A_F: r_.a = r_.f; break;
+		case LD_A_L: r_.a = r_.l; break;
+		case LD_B_A: r_.b = r_.a; break;
+		case LD_B_B: break;
+		case LD_B_C: r_.b = r_.c; break;
+		case LD_B_D: r_.b = r_.d; break;
+		case LD_B_E: r_.b = r_.e; break;
+		case LD_B_F: r_.b = r_.f; break;
+		case LD_B_L: r_.b = r_.l; break;
+		case LD_C_A: r_.c = r_.a; break;
+		case LD_C_B: r_.c = r_.b; break;
+		case LD_C_C: break;
+		case LD_C_D: r_.c = r_.d; break;
+		case LD_C_E: r_.c = r_.e; break;
+		case LD_C_F: r_.c = r_.f; break;
+		case LD_C_L: r_.c = r_.l; break;
+		case LD_D_A: r_.d = r_.a; break;
+		case LD_D_B: r_.d = r_.b; break;
+		case LD_D_C: r_.d = r_.c; break;
+		case LD_D_D: break;
+		case LD_D_E: r_.d = r_.e; break;
+		case LD_D_F: r_.d = r_.f; break;
+		case LD_D_L: r_.d = r_.l; break;
+		case LD_E_A: r_.e = r_.a; break;
+		case LD_E_B: r_.e = r_.b; break;
+		case LD_E_C: r_.e = r_.c; break;
+		case LD_E_D: r_.e = r_.d; break;
+		case LD_E_E: break;
+		case LD_E_F: r_.e = r_.f; break;
+		case LD_E_L: r_.e = r_.l; break;
+		case LD_H_A: r_.h = r_.a; break;
+		case LD_H_B: r_.h = r_.b; break;
+		case LD_H_C: r_.h = r_.c; break;
+		case LD_H_D: r_.h = r_.d; break;
+		case LD_H_E: r_.h = r_.e; break;
+		case LD_H_F: r_.h = r_.f; break;
+		case LD_H_L: r_.h = r_.l; break;
+		case LD_L_A: r_.l = r_.a; break;
+		case LD_L_B: r_.l = r_.b; break;
+		case LD_L_C: r_.l = r_.c; break;
+		case LD_L_D: r_.l = r_.d; break;
+		case LD_L_E: r_.l = r_.e; break;
+		case LD_L_F: r_.l = r_.f; break;
+		case LD_L_L: break;
+		case LD_A_ind_HL: r_.a = read(r_.hl); break;
+		case LD_A_ind_BC: r_.a = read(r_.bc); break;
+		case LD_A_ind_DE: r_.a = read(r_.de); break;
+		case LD_B_ind_HL: r_.b = read(r_.hl); break;
+		case LD_C_ind_HL: r_.c = read(r_.hl); break;
+		case LD_D_ind_HL: r_.d = read(r_.hl); break;
+		case LD_E_ind_HL: r_.e = read(r_.hl); break;
+		case LD_H_ind_HL: r_.h = read(r_.hl); break;
+		case LD_L_ind_HL: r_.l = read(r_.hl); break;
+		case LD_ind_HL_A: write(r_.hl, r_.a); break;
+		case LD_ind_HL_B: write(r_.hl, r_.b); break;
+		case LD_ind_HL_C: write(r_.hl, r_.c); break;
+		case LD_ind_HL_D: write(r_.hl, r_.d); break;
+		case LD_ind_HL_E: write(r_.hl, r_.e); break;
+		case LD_ind_HL_F: write(r_.hl, r_.f); break;
+		case LD_ind_HL_L: write(r_.hl, r_.l); break;
+		case LD_ind_BC_A: write(r_.bc, r_.a); break;
+		case LD_ind_DE_A: write(r_.de, r_.a); break;
+		case LD_ext_A: write(next16(), r_.a); break;
+		case ADD_A_A: r_.a = op_add(r_.a, r_.a); break;
+		case ADD_A_B: r_.a = op_add(r_.a, r_.b); break;
+		case ADD_A_C: r_.a = op_add(r_.a, r_.c); break;
+		case ADD_A_D: r_.a = op_add(r_.a, r_.d); break;
+		case ADD_A_E: r_.a = op_add(r_.a, r_.e); break;
+		case ADD_A_F: r_.a = op_add(r_.a, r_.f); break;
+		case ADD_A_L: r_.a = op_add(r_.a, r_.l); break;
+		case ADD_A_ind_HL: r_.a = op_add(r_.a, read(r_.hl)); break;
+		case ADD_A_imm: r_.a = op_add(r_.a, next()); break;
+		case ADC_A_A: r_.a = op_adc(r_.a, r_.a); break;
+		case ADC_A_B: r_.a = op_adc(r_.a, r_.b); break;
+		case ADC_A_C: r_.a = op_adc(r_.a, r_.c); break;
+		case ADC_A_D: r_.a = op_adc(r_.a, r_.d); break;
+		case ADC_A_E: r_.a = op_adc(r_.a, r_.e); break;
+		case ADC_A_F: r_.a = op_adc(r_.a, r_.f); break;
+		case ADC_A_L: r_.a = op_adc(r_.a, r_.l); break;
+		case ADC_A_ind_HL: r_.a = op_adc(r_.a, read(r_.hl)); break;
+		case ADC_A_imm: r_.a = op_adc(r_.a, next()); break;
+		case SUB_A_A: r_.a = op_sub(r_.a, r_.a); break;
+		case SUB_A_B: r_.a = op_sub(r_.a, r_.b); break;
+		case SUB_A_C: r_.a = op_sub(r_.a, r_.c); break;
+		case SUB_A_D: r_.a = op_sub(r_.a, r_.d); break;
+		case SUB_A_E: r_.a = op_sub(r_.a, r_.e); break;
+		case SUB_A_F: r_.a = op_sub(r_.a, r_.f); break;
+		case SUB_A_L: r_.a = op_sub(r_.a, r_.l); break;
+		case SUB_A_ind_HL: r_.a = op_sub(r_.a, read(r_.hl)); break;
+		case SUB_A_imm: r_.a = op_sub(r_.a, next()); break;
+		case SBC_A_A: r_.a = op_sbc(r_.a, r_.a); break;
+		case SBC_A_B: r_.a = op_sbc(r_.a, r_.b); break;
+		case SBC_A_C: r_.a = op_sbc(r_.a, r_.c); break;
+		case SBC_A_D: r_.a = op_sbc(r_.a, r_.d); break;
+		case SBC_A_E: r_.a = op_sbc(r_.a, r_.e); break;
+		case SBC_A_F: r_.a = op_sbc(r_.a, r_.f); break;
+		case SBC_A_L: r_.a = op_sbc(r_.a, r_.l); break;
+		case SBC_A_ind_HL: r_.a = op_sbc(r_.a, read(r_.hl)); break;
+		case SBC_A_imm: r_.a = op_sbc(r_.a, next()); break;
+		case AND_A_A: r_.a = op_and(r_.a, r_.a); break;
+		case AND_A_B: r_.a = op_and(r_.a, r_.b); break;
+		case AND_A_C: r_.a = op_and(r_.a, r_.c); break;
+		case AND_A_D: r_.a = op_and(r_.a, r_.d); break;
+		case AND_A_E: r_.a = op_and(r_.a, r_.e); break;
+		case AND_A_F: r_.a = op_and(r_.a, r_.f); break;
+		case AND_A_L: r_.a = op_and(r_.a, r_.l); break;
+		case AND_A_ind_HL: r_.a = op_and(r_.a, read(r_.hl)); break;
+		case AND_A_imm: r_.a = op_and(r_.a, next()); break;
+		case XOR_A_A: r_.a = op_xor(r_.a, r_.a); break;
+		case XOR_A_B: r_.a = op_xor(r_.a, r_.b); break;
+		case XOR_A_C: r_.a = op_xor(r_.a, r_.c); break;
+		case XOR_A_D: r_.a = op_xor(r_.a, r_.d); break;
+		case XOR_A_E: r_.a = op_xor(r_.a, r_.e); break;
+		case XOR_A_F: r_.a = op_xor(r_.a, r_.f); break;
+		case XOR_A_L: r_.a = op_xor(r_.a, r_.l); break;
+		case XOR_A_ind_HL: r_.a = op_xor(r_.a, read(r_.hl)); break;
+		case XOR_A_imm: r_.a = op_xor(r_.a, next()); break;
+		case OR_A_A: r_.a = op_or(r_.a, r_.a); break;
+		case OR_A_B: r_.a = op_or(r_.a, r_.b); break;
+		case OR_A_C: r_.a = op_or(r_.a, r_.c); break;
+		case OR_A_D: r_.a = op_or(r_.a, r_.d); break;
+		case OR_A_E: r_.a = op_or(r_.a, r_.e); break;
+		case OR_A_F: r_.a = op_or(r_.a, r_.f); break;
+		case OR_A_L: r_.a = op_or(r_.a, r_.l); break;
+		case OR_A_ind_HL: r_.a = op_or(r_.a, read(r_.hl)); break;
+		case OR_A_imm: r_.a = op_or(r_.a, next()); break;
+		case CP_A: op_cp(r_.a); break;
+		case CP_B: op_cp(r_.b); break;
+		case CP_C: op_cp(r_.c); break;
+		case CP_D: op_cp(r_.d); break;
+		case CP_E: op_cp(r_.e); break;
+		case CP_F: op_cp(r_.f); break;
+		case CP_L: op_cp(r_.l); break;
+		case CP_ind_HL: op_cp(read(r_.hl)); break;
+		case CP_imm: op_cp(next()); break;
+		case INC_A: r_.a = op_inc(r_.a); break;
+		case INC_B: r_.b = op_inc(r_.b); break;
+		case INC_C: r_.c = op_inc(r_.c); break;
+		case INC_D: r_.d = op_inc(r_.d); break;
+		case INC_E: r_.e = op_inc(r_.e); break;
+		case INC_F: r_.f = op_inc(r_.f); break;
+		case INC_L: r_.l = op_inc(r_.l); break;
+		case INC_ind_HL: write(r_.hl, op_inc(read(r_.hl))); break;
+		case DEC_A: r_.a = op_dec(r_.a); break;
+		case DEC_B: r_.b = op_dec(r_.b); break;
+		case DEC_C: r_.c = op_dec(r_.c); break;
+		case DEC_D: r_.d = op_dec(r_.d); break;
+		case DEC_E: r_.e = op_dec(r_.e); break;
+		case DEC_F: r_.f = op_dec(r_.f); break;
+		case DEC_L: r_.l = op_dec(r_.l); break;
+		case DEC_ind_HL: write(r_.hl, op_dec(read(r_.hl))); break;
+		case JP: r_.pc = next16(); break;
+		case JP_C: tmp16 = next16(); if (fc()) r_.pc = tmp16; break;
+		case JP_NC: tmp16 = next16(); if (!fc()) r_.pc = tmp16; break;
+		case JP_Z: tmp16 = next16(); if (fz()) r_.pc = tmp16; break;
+		case JP_NZ: tmp16 = next16(); if (!fz()) r_.pc = tmp16; break;
+		case JP_PO: tmp16 = next16(); if (!fpv()) r_.pc = tmp16; break;
+		case JP_PE: tmp16 = next16(); if (fpv()) r_.pc = tmp16; break;
+		case JP_M: tmp16 = next16(); if (fs()) r_.pc = tmp16; break;
+		case JP_P: tmp16 = next16(); if (!fs()) r_.pc = tmp16; break;
+		case JP_ind_HL: r_.pc = r_.hl; break;
+		case JR: tmp = next(); r_.pc += *((int8_t*)&tmp); break;
+		case JR_C: tmp = next(); if (fc()) { r_.pc += *((int8_t*)&tmp); tick(5); } break;
+		case JR_NC: tmp = next(); if (!fc()) { r_.pc += *((int8_t*)&tmp); tick(5); } break;
+		case JR_Z: tmp = next(); if (fz()) { r_.pc += *((int8_t*)&tmp); tick(5); } break;
+		case JR_NZ: tmp = next(); if (!fz()) { r_.pc += *((int8_t*)&tmp); tick(5); } break;
+		case DJNZ: tmp = next(); if (--r_.b) { r_.pc += *((int8_t*)&tmp); tick(5); } break;
+		case INC_BC: r_.bc++; break;
+		case INC_DE: r_.de++; break;
+		case INC_HL: r_.hl++; break;
+		case INC_SP: r_.sp++; break;
+		case DEC_BC: r_.bc--; break;
+		case DEC_DE: r_.de--; break;
+		case DEC_HL: r_.hl--; break;
+		case DEC_SP: r_.sp--; break;
+		case ADD_HL_BC: op_add16(r_.bc); break;
+		case ADD_HL_DE: op_add16(r_.de); break;
+		case ADD_HL_HL: op_add16(r_.hl); break;
+		case ADD_HL_SP: op_add16(r_.sp); break;
+		case EX_AF_AF2: swap(r_.af, r_.af2); break;
+		case EXX: swap(r_.bc, r_.bc2); swap(r_.de, r_.de2); swap(r_.hl, r_.hl2); break;
+		case LD_BC_imm: r_.bc = next16(); break;
+		case LD_DE_imm: r_.de = next16(); break;
+		case LD_HL_imm: r_.hl = next16(); break;
+		case LD_SP_imm: r_.sp = next16(); break;
+		case PUSH_AF: push(r_.af); break;
+		case PUSH_BC: push(r_.bc); break;
+		case PUSH_DE: push(r_.de); break;
+		case PUSH_HL: push(r_.hl); break;
+		case POP_AF: r_.af = pop(); break;
+		case POP_BC: r_.bc = pop(); break;
+		case POP_DE: r_.de = pop(); break;
+		case POP_HL: r_.hl = pop(); break;
+		case CALL: op_call(next16()); break;
+		case CALL_C: tmp16 = next16(); if (fc()) { tick(7); op_call(tmp16); } break;
+		case CALL_NC: tmp16 = next16(); if (!fc()) { tick(7); op_call(tmp16); } break;
+		case CALL_Z: tmp16 = next16(); if (fz()) { tick(7); op_call(tmp16); } break;
+		case CALL_NZ: tmp16 = next16(); if (!fz()) { tick(7); op_call(tmp16); } break;
+		case CALL_PO: tmp16 = next16(); if (!fpv()) { tick(7); op_call(tmp16); } break;
+		case CALL_PE: tmp16 = next16(); if (fpv()) { tick(7); op_call(tmp16); } break;
+		case CALL_M: tmp16 = next16(); if (fs()) { tick(7); op_call(tmp16); } break;
+		case CALL_P: tmp16 = next16(); if (!fs()) { tick(7); op_call(tmp16); } break;
+		case RET: op_ret(); break;
+		case RET_C: if (fc()) { tick(6); op_ret(); } break;
+		case RET_NC: if (!fc()) { tick(6); op_ret(); } break;
+		case RET_Z: if (fz()) { tick(6); op_ret(); } break;
+		case RET_NZ: if (!fz()) { tick(6); op_ret(); } break;
+		case RET_PO: if (!fpv()) { tick(6); op_ret(); } break;
+		case RET_PE: if (fpv()) { tick(6); op_ret(); } break;
+		case RET_M: if (fs()) { tick(6); op_ret(); } break;
+		case RET_P: if (!fs()) { tick(6); op_ret(); } break;
+		
+		case EXT_DD:
+			tick(CYCLES_IDX[code = next()]);
+			switch (code) {
+				case DD_LD_B_imm: r_.b = next(); break;
+				case DD_LD_C_imm: r_.c = next(); break;
+				case DD_LD_D_imm: r_.d = next(); break;
+				case DD_LD_E_imm: r_.e = next(); break;
+				case DD_LD_H_imm: r_.h = next(); break;
+				case DD_LD_A_idx_IY: r_.a = read(idx(r_.iy)); break;
+				case DD_LD_B_idx_IX: r_.b = read(idx(r_.ix)); break;
+				case DD_LD_C_idx_IX: r_.c = read(idx(r_.ix)); break;
+				case DD_LD_D_idx_IX: r_.d = read(idx(r_.ix)); break;
+				case DD_LD_E_idx_IX: r_.e = read(idx(r_.ix)); break;
+				case DD_LD_H_idx_IX: r_.h = read(idx(r_.ix)); break;
+				case DD_LD_L_idx_IX: r_.l = read(idx(r_.ix)); break;
+				case DD_LD_idx_IX_A: write(idx(r_.ix), r_.a); break;
+				case DD_LD_idx_IX_B: write(idx(r_.ix), r_.b); break;
+				case DD_LD_idx_IX_C: write(idx(r_.ix), r_.c); break;
+				case DD_LD_idx_IX_D: write(idx(r_.ix), r_.d); break;
+				case DD_LD_idx_IX_E: write(idx(r_.ix), r_.e); break;
+				case DD_LD_idx_IX_F: write(idx(r_.ix), r_.f); break;
+				case DD_LD_idx_IX_L: write(idx(r_.ix), r_.l); break;
+				case DD_INC_idx_IX: tmp16 = idx(r_.ix); write(tmp16, op_inc(read(tmp16))); break;
+				case DD_DEC_idx_IX: tmp16 = idx(r_.ix); write(tmp16, op_dec(read(tmp16))); break;
+				case DD_LD_idx_IX_imm: tmp16 = idx(r_.ix); write(tmp16, next()); break;
+				case DD_LD_ind_HL_imm: write(r_.hl, next()); break;
+				case DD_ADD_A_idx_IX: r_.a = op_add(r_.a, read(idx(r_.ix))); break;
+				case DD_ADC_A_idx_IX: r_.a = op_adc(r_.a, read(idx(r_.ix))); break;
+				case DD_SUB_A_idx_IX: r_.a = op_sub(r_.a, read(idx(r_.ix))); break;
+				case DD_SBC_A_idx_IX: r_.a = op_sbc(r_.a, read(idx(r_.ix))); break;
+				case DD_AND_A_idx_IX: r_.a = op_and(r_.a, read(idx(r_.ix))); break;
+				case DD_XOR_A_idx_IX: r_.a = op_xor(r_.a, read(idx(r_.ix))); break;
+				case DD_OR_A_idx_IX: r_.a = op_or(r_.a, read(idx(r_.ix))); break;
+				case DD_CP_idx_IX: op_cp(read(idx(r_.ix))); break;
+				case DD_JP_ind_IX: r_.pc = r_.ix; break;
+
+				default:
+					illegal(r_.pc - 2);
+					break;
+			}
+			break;
+			
+		case EXT_ED:
+			switch (code = next()) {
+				case ED_LD_imp_I_A: r_.i = r_.a; tick(5); break;
+				case ED_LD_imp_R_A: r_.r = r_.a; tick(5); break;
+				case ED_LDI: op_ldi(1); tick(12); break;
+				case ED_LDD: op_ldi(-1); tick(12); break;
+				case ED_CPI: op_cpi(1); tick(12); break;
+				case ED_LDIR:
+					op_ldi(1);
+					tick(12);
+					if (r_.bc) { r_.pc -= 2; tick(5); }
+					break;
+				case ED_LDDR:
+					op_ldi(-1);
+					tick(12);
+					if (r_.bc) { r_.pc -= 2; tick(5); }
+					break;
+				case ED_CPIR:
+					op_cpi(1);
+					tick(12);
+					if (r_.bc && !fz()) { r_.pc -= 2; tick(5); }
+					break;
+				case ED_INIR:
+					op_ini();
+					tick(12);
+					if (r_.b) { r_.pc -= 2; tick(5); }
+					break;
+				case ED_OTIR:
+					op_outi();
+					tick(12);
+					if (r_.b) { r_.pc -= 2; tick(5); }
+					break;
+					
+				default:
+					illegal(r_.pc - 2);
+					break;
+			}
+			break;
+			
+		case EXT_FD:
+			tick(CYCLES_IDX[code = next()]);
+			switch (code) {
+				case FD_LD_A_imm: r_.a = next(); break;
+				case FD_LD_A_ext: r_.a = read(next16()); break;
+				case FD_LD_A_idx_IX: r_.a = read(idx(r_.ix)); break;
+				case FD_LD_B_idx_IY: r_.b = read(idx(r_.iy)); break;
+				case FD_LD_C_idx_IY: r_.c = read(idx(r_.iy)); break;
+				case FD_LD_D_idx_IY: r_.d = read(idx(r_.iy)); break;
+				case FD_LD_E_idx_IY: r_.e = read(idx(r_.iy)); break;
+				case FD_LD_H_idx_IY: r_.h = read(idx(r_.iy)); break;
+				case FD_LD_idx_IY_A: write(idx(r_.iy), r_.a); break;
+				case FD_LD_idx_IY_B: write(idx(r_.iy), r_.b); break;
+				case FD_LD_idx_IY_C: write(idx(r_.iy), r_.c); break;
+				case FD_LD_idx_IY_D: write(idx(r_.iy), r_.d); break;
+				case FD_LD_idx_IY_E: write(idx(r_.iy), r_.e); break;
+				case FD_LD_idx_IY_F: write(idx(r_.iy), r_.f); break;
+				case FD_LD_idx_IY_L: write(idx(r_.iy), r_.l); break;
+				case FD_INC_idx_IY: tmp16 = idx(r_.iy); write(tmp16, op_inc(read(tmp16))); break;
+				case FD_DEC_idx_IY: tmp16 = idx(r_.iy); write(tmp16, op_dec(read(tmp16))); break;
+				case FD_LD_idx_IY_imm: tmp16 = idx(r_.iy); write(tmp16, next()); break;
+				case FD_ADD_A_idx_IY: r_.a = op_add(r_.a, read(idx(r_.iy))); break;
+				case FD_ADC_A_idx_IY: r_.a = op_adc(r_.a, read(idx(r_.iy))); break;
+				case FD_SUB_A_idx_IY: r_.a = op_sub(r_.a, read(idx(r_.iy))); break;
+				case FD_SBC_A_idx_IY: r_.a = op_sbc(r_.a, read(idx(r_.iy))); break;
+				case FD_AND_A_idx_IY: r_.a = op_and(r_.a, read(idx(r_.iy))); break;
+				case FD_XOR_A_idx_IY: r_.a = op_xor(r_.a, read(idx(r_.iy))); break;
+				case FD_OR_A_idx_IY: r_.a = op_or(r_.a, read(idx(r_.iy))); break;
+				case FD_CP_idx_IY: op_cp(read(idx(r_.iy))); break;
+				case FD_JP_ind_IY: r_.pc = r_.iy; break;
+					
+				default:
+					illegal(r_.pc - 2);
+					break;
+			}
+			break;
+			
+		default:
+			illegal(r_.pc - 1);
+			break;
+	}
+}
+
+template <class Policy>
+Stop Z80Core<Policy>::run_to_nop(ostream *trace, uint64_t limit)
+{
+	bool resume = stop_ == STOP_BREAKPOINT && stop_addr_ == r_.pc;
+	uint64_t end = Policy::cycles ? (limit > ~0ull - cycles_ ? ~0ull : cycles_ + limit) : limit;
+	uint64_t n = 0;
+	stop_ = STOP_NONE;
+	uint16_t block = r_.pc;
+	idle_reset();
+	if (!Policy::trace)
+		trace = nullptr;
+	
+	if (trace)
+		trace_start();
+	
+	for (; mem(r_.pc); n++) {
+		if (Policy::watch && (page_flags_[r_.pc >> PAGE_BITS] & PAGE_BREAK) && !resume && check_breakpoint()) {
+			stop_ = STOP_BREAKPOINT;
+			stop_addr_ = r_.pc;
+			break;
+		}
+		resume = false;
+		
+		if (trace)
+			trace_insn(*trace);
+		
+		uint16_t pc = r_.pc;
+		step();
+		
+		if (trace)
+			trace_regs();
+		
+		if (stop_)
+			break;
+		
+		if ((uint16_t)(r_.pc - pc - 1) >= 4) {
+			if (r_.pc == pc && fast_block_ && !trace)
+				n += bulk_repeat(pc, Policy::cycles ? cycles_ : n + 1, end);
+			if (r_.pc <= pc && r_.pc != idle_miss_ && idle_skip_ && !trace)
+				n += idle_skip(pc, Policy::cycles ? cycles_ : n + 1, end, Policy::cycles, Policy::watch);
+			if (sampler_ && SampleProfiler::due.load(memory_order_relaxed))
+				take_sample(block);
+			block = r_.pc;
+			
+			// only checked here, so that straight-line code can overshoot
+			if ((Policy::cycles ? cycles_ : n + 1) >= end && mem(r_.pc)) {
+				stop_ = STOP_LIMIT;
+				stop_addr_ = r_.pc;
+				break;
+			}
+		}
+	}
+	
+	if (trace)
+		trace_stop(*trace);
+	
+	if (stop_ == STOP_NONE)
+		stop_ = STOP_NOP;
+	
+	return stop_;
+}
+
+template <class Policy>
+Stop Z80Core<Policy>::run_for(uint64_t cycles)
+{
+	bool resume = stop_ == STOP_BREAKPOINT && stop_addr_ == r_.pc;
+	uint64_t end = cycles > ~0ull - cycles_ ? ~0ull : cycles_ + cycles;
+	uint16_t block = r_.pc;
+	stop_ = STOP_NONE;
+	idle_reset();
+	
+	for (uint64_t n = 0; Policy::cycles ? cycles_ < end : n < cycles; n++) {
+		if (Policy::watch && (page_flags_[r_.pc >> PAGE_BITS] & PAGE_BREAK) && !resume && check_breakpoint()) {
+			stop_ = STOP_BREAKPOINT;
+			stop_addr_ = r_.pc;
+			break;
+		}
+		resume = false;
+		
+		uint16_t pc = r_.pc;
+		step();
+		
+		if (stop_)
+			break;
+		
+		// anything but a step of up to four bytes ends a block
+		if ((uint16_t)(r_.pc - pc - 1) >= 4) {
+			if (r_.pc == pc && fast_block_)
+				n += bulk_repeat(pc, Policy::cycles ? cycles_ : n + 1, Policy::cycles ? end : cycles);
+			if (r_.pc <= pc && r_.pc != idle_miss_ && idle_skip_)
+				n += idle_skip(pc, Policy::cycles ? cycles_ : n + 1, Policy::cycles ? end : cycles,
+					Policy::cycles, Policy::watch);
+			if (sampler_ && SampleProfiler::due.load(memory_order_relaxed))
+				take_sample(block);
+			block = r_.pc;
+		}
+	}
+	
+	return stop_;
+}
+
+template <unsigned Bits>
+static Z80Base *new_core(PageArena *arena)
+{
+	return new Z80Core<FeaturePolicy<Bits>>(arena);
+}
+
+unique_ptr<Z80Base> make_z80(unsigned features, PageArena *arena)
+{
+	typedef Z80Base *(*Factory)(PageArena *);
+	static const Factory factories[] = {
+		new_core<0x00>, new_core<0x01>, new_core<0x02>, new_core<0x03>,
+		new_core<0x04>, new_core<0x05>, new_core<0x06>, new_core<0x07>,
+		new_core<0x08>, new_core<0x09>, new_core<0x0A>, new_core<0x0B>,
+		new_core<0x0C>, new_core<0x0D>, new_core<0x0E>, new_core<0x0F>,
+		new_core<0x10>, new_core<0x11>, new_core<0x12>, new_core<0x13>,
+		new_core<0x14>, new_core<0x15>, new_core<0x16>, new_core<0x17>,
+		new_core<0x18>, new_core<0x19>, new_core<0x1A>, new_core<0x1B>,
+		new_core<0x1C>, new_core<0x1D>, new_core<0x1E>, new_core<0x1F>
+	};
+	
+	return unique_ptr<Z80Base>(factories[features & (FEATURE_ALL | FEATURE_COMPACT)](arena));
+}
+
+template class Z80Core<FeaturePolicy<0x00>>;
+template class Z80Core<FeaturePolicy<0x01>>;
+template class Z80Core<FeaturePolicy<0x02>>;
+template class Z80Core<FeaturePolicy<0x03>>;
+template class Z80Core<FeaturePolicy<0x04>>;
+template class Z80Core<FeaturePolicy<0x05>>;
+template class Z80Core<FeaturePolicy<0x06>>;
+template class Z80Core<FeaturePolicy<0x07>>;
+template class Z80Core<FeaturePolicy<0x08>>;
+template class Z80Core<FeaturePolicy<0x09>>;
+template class Z80Core<FeaturePolicy<0x0A>>;
+template class Z80Core<FeaturePolicy<0x0B>>;
+template class Z80Core<FeaturePolicy<0x0C>>;
+template class Z80Core<FeaturePolicy<0x0D>>;
+template class Z80Core<FeaturePolicy<0x0E>>;
+template class Z80Core<FeaturePolicy<0x0F>>;
+template class Z80Core<FeaturePolicy<0x10>>;
+template class Z80Core<FeaturePolicy<0x11>>;
+template class Z80Core<FeaturePolicy<0x12>>;
+template class Z80Core<FeaturePolicy<0x13>>;
+template class Z80Core<FeaturePolicy<0x14>>;
+template class Z80Core<FeaturePolicy<0x15>>;
+template class Z80Core<FeaturePolicy<0x16>>;
+template class Z80Core<FeaturePolicy<0x17>>;
+template class Z80Core<FeaturePolicy<0x18>>;
+template class Z80Core<FeaturePolicy<0x19>>;
+template class Z80Core<FeaturePolicy<0x1A>>;
+template class Z80Core<FeaturePolicy<0x1B>>;
+template class Z80Core<FeaturePolicy<0x1C>>;
+template class Z80Core<FeaturePolicy<0x1D>>;
+template class Z80Core<FeaturePolicy<0x1E>>;
+template class Z80Core<FeaturePolicy<0x1F>>;
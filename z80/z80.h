@@ -0,0 +1,1067 @@
+//
+//  z80.h
+//  z80
+//
+//  The emulator core. Link against the static libz80.a; libz80.so only
+//  exports the C API in z80_c.h.
+//
+
+#ifndef Z80_H
+#define Z80_H
+
+#include <array>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <iosfwd>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+const int CPU_HZ = 3580 * 1000;
+const int MEM_SIZE = 64 * 1024;
+const int PAGE_BITS = 10;
+const int PAGE_SIZE = 1 << PAGE_BITS;
+const int PAGE_COUNT = MEM_SIZE / PAGE_SIZE;
+
+enum Op : uint8_t {
+	NOOP = 0x00,
+	LD_BC_imm = 0x01,
+	LD_ind_BC_A = 0x02,
+	INC_BC = 0x03,
+	INC_B = 0x04,
+	DEC_B = 0x05,
+	EX_AF_AF2 = 0x08,
+	ADD_HL_BC = 0x09,
+	LD_A_ind_BC = 0x0A,
+	DEC_BC = 0x0B,
+	INC_C = 0x0C,
+	DEC_C = 0x0D,
+	DJNZ = 0x10,
+	LD_DE_imm = 0x11,
+	LD_ind_DE_A = 0x12,
+	INC_DE = 0x13,
+	INC_D = 0x14,
+	DEC_D = 0x15,
+	JR = 0x18,
+	ADD_HL_DE = 0x19,
+	LD_A_ind_DE = 0x1A,
+	DEC_DE = 0x1B,
+	INC_E = 0x1C,
+	DEC_E = 0x1D,
+	JR_NZ = 0x20,
+	LD_HL_imm = 0x21,
+	INC_HL = 0x23,
+	INC_F = 0x24,
+	DEC_F = 0x25,
+	JR_Z = 0x28,
+	ADD_HL_HL = 0x29,
+	DEC_HL = 0x2B,
+	INC_L = 0x2C,
+	DEC_L = 0x2D,
+	JR_NC = 0x30,
+	LD_SP_imm = 0x31,
+	LD_ext_A = 0x32,
+	INC_SP = 0x33,
+	INC_ind_HL = 0x34,
+	DEC_ind_HL = 0x35,
+	JR_C = 0x38,
+	ADD_HL_SP = 0x39,
+	DEC_SP = 0x3B,
+	INC_A = 0x3C,
+	DEC_A = 0x3D,
+	LD_B_B = 0x40,
+	LD_B_C,
+	LD_B_D,
+	LD_B_E,
+	LD_B_F,
+	LD_B_L,
+	LD_B_ind_HL,
+	LD_B_A,
+	LD_C_B,
+	LD_C_C,
+	LD_C_D,
+	LD_C_E,
+	LD_C_F,
+	LD_C_L,
+	LD_C_ind_HL,
+	LD_C_A,
+	LD_D_B,
+	LD_D_C,
+	LD_D_D,
+	LD_D_E,
+	LD_D_F,
+	LD_D_L,
+	LD_D_ind_HL,
+	LD_D_A,
+	LD_E_B,
+	LD_E_C,
+	LD_E_D,
+	LD_E_E,
+	LD_E_F,
+	LD_E_L,
+	LD_E_ind_HL,
+	LD_E_A,
+	LD_H_B,
+	LD_H_C,
+	LD_H_D,
+	LD_H_E,
+	LD_H_F,
+	LD_H_L,
+	LD_H_ind_HL,
+	LD_H_A,
+	LD_L_B,
+	LD_L_C,
+	LD_L_D,
+	LD_L_E,
+	LD_L_F,
+	LD_L_L,
+	LD_L_ind_HL,
+	LD_L_A,
+	LD_ind_HL_B,
+	LD_ind_HL_C,
+	LD_ind_HL_D,
+	LD_ind_HL_E,
+	LD_ind_HL_F,
+	LD_ind_HL_L = 0x75,
+	LD_ind_HL_A = 0x77,
+	LD_A_B,
+	LD_A_C,
+	LD_A_D,
+	LD_A_E,
+	LD_A_F,
+	LD_A_L,
+	LD_A_ind_HL,
+	LD_A_A,
+	ADD_A_B,
+	ADD_A_C,
+	ADD_A_D,
+	ADD_A_E,
+	ADD_A_F,
+	ADD_A_L,
+	ADD_A_ind_HL,
+	ADD_A_A,
+	ADC_A_B,
+	ADC_A_C,
+	ADC_A_D,
+	ADC_A_E,
+	ADC_A_F,
+	ADC_A_L,
+	ADC_A_ind_HL,
+	ADC_A_A,
+	SUB_A_B,
+	SUB_A_C,
+	SUB_A_D,
+	SUB_A_E,
+	SUB_A_F,
+	SUB_A_L,
+	SUB_A_ind_HL,
+	SUB_A_A,
+	SBC_A_B,
+	SBC_A_C,
+	SBC_A_D,
+	SBC_A_E,
+	SBC_A_F,
+	SBC_A_L,
+	SBC_A_ind_HL,
+	SBC_A_A,
+	AND_A_B,
+	AND_A_C,
+	AND_A_D,
+	AND_A_E,
+	AND_A_F,
+	AND_A_L,
+	AND_A_ind_HL,
+	AND_A_A,
+	XOR_A_B,
+	XOR_A_C,
+	XOR_A_D,
+	XOR_A_E,
+	XOR_A_F,
+	XOR_A_L,
+	XOR_A_ind_HL,
+	XOR_A_A,
+	OR_A_B,
+	OR_A_C,
+	OR_A_D,
+	OR_A_E,
+	OR_A_F,
+	OR_A_L,
+	OR_A_ind_HL,
+	OR_A_A,
+	CP_B,
+	CP_C,
+	CP_D,
+	CP_E,
+	CP_F,
+	CP_L,
+	CP_ind_HL,
+	CP_A = 0xBF,
+	RET_NZ = 0xC0,
+	POP_BC = 0xC1,
+	JP_NZ = 0xC2,
+	JP = 0xC3,
+	CALL_NZ = 0xC4,
+	PUSH_BC = 0xC5,
+	ADD_A_imm = 0xC6,
+	RET_Z = 0xC8,
+	RET = 0xC9,
+	JP_Z = 0xCA,
+	CALL_Z = 0xCC,
+	CALL = 0xCD,
+	ADC_A_imm = 0xCE,
+	RET_NC = 0xD0,
+	POP_DE = 0xD1,
+	JP_NC = 0xD2,
+	CALL_NC = 0xD4,
+	PUSH_DE = 0xD5,
+	SUB_A_imm = 0xD6,
+	RET_C = 0xD8,
+	EXX = 0xD9,
+	JP_C = 0xDA,
+	CALL_C = 0xDC,
+	EXT_DD = 0xDD,
+	SBC_A_imm = 0xDE,
+	RET_PO = 0xE0,
+	POP_HL = 0xE1,
+	JP_PO = 0xE2,
+	CALL_PO = 0xE4,
+	PUSH_HL = 0xE5,
+	AND_A_imm = 0xE6,
+	RET_PE = 0xE8,
+	JP_PE = 0xEA,
+	JP_ind_HL = 0xEB,
+	CALL_PE = 0xEC,
+	EXT_ED = 0xED,
+	XOR_A_imm = 0xEE,
+	RET_P = 0xF0,
+	POP_AF = 0xF1,
+	JP_P = 0xF2,
+	CALL_P = 0xF4,
+	PUSH_AF = 0xF5,
+	OR_A_imm = 0xF6,
+	RET_M = 0xF8,
+	JP_M = 0xFA,
+	CALL_M = 0xFC,
+	EXT_FD = 0xFD,
+	CP_imm = 0xFE
+};
+
+enum DDOp : uint8_t {
+	DD_LD_D_imm = 0x1B,
+	DD_LD_E_imm = 0x1E,
+	DD_LD_H_imm = 0x2B,
+	DD_INC_idx_IX = 0x34,
+	DD_DEC_idx_IX = 0x35,
+	DD_LD_idx_IX_imm = 0x36,
+	DD_LD_B_idx_IX = 0x46,
+	DD_LD_C_idx_IX = 0x4E,
+	DD_LD_D_idx_IX = 0x56,
+	DD_LD_E_idx_IX = 0x5E,
+	DD_LD_H_idx_IX = 0x66,
+	DD_LD_L_idx_IX = 0x6E,
+	DD_LD_idx_IX_B = 0x70,
+	DD_LD_idx_IX_C,
+	DD_LD_idx_IX_D,
+	DD_LD_idx_IX_E,
+	DD_LD_idx_IX_F,
+	DD_LD_idx_IX_L,
+	DD_LD_idx_IX_A,
+	DD_LD_ind_HL_imm = 0x78,
+	DD_LD_A_idx_IY = 0x7E,
+	DD_ADD_A_idx_IX = 0x86,
+	DD_ADC_A_idx_IX = 0x8E,
+	DD_SUB_A_idx_IX = 0x96,
+	DD_SBC_A_idx_IX = 0x9E,
+	DD_AND_A_idx_IX = 0xA6,
+	DD_XOR_A_idx_IX = 0xAE,
+	DD_OR_A_idx_IX = 0xB6,
+	DD_CP_idx_IX = 0xBE,
+	DD_LD_B_imm = 0xD5,
+	DD_LD_C_imm = 0xDE,
+	DD_JP_ind_IX = 0xE9
+};
+
+enum EDOp : uint8_t {
+	ED_LD_imp_I_A = 0x47,
+	ED_LD_imp_R_A = 0x4F,
+	ED_LDI = 0xA0,
+	ED_CPI = 0xA1,
+	ED_LDD = 0xA8,
+	ED_LDIR = 0xB0,
+	ED_CPIR = 0xB1,
+	ED_INIR = 0xB2,
+	ED_OTIR = 0xB3,
+	ED_LDDR = 0xB8
+};
+
+enum FDOp : uint8_t {
+	FD_LD_A_imm = 0x2E,
+	FD_LD_idx_IY_imm = 0x36,
+	FD_LD_A_ext = 0x3A,
+	FD_INC_idx_IY = 0x34,
+	FD_DEC_idx_IY = 0x35,
+	FD_LD_B_idx_IY = 0x46,
+	FD_LD_C_idx_IY = 0x4E,
+	FD_LD_D_idx_IY = 0x56,
+	FD_LD_E_idx_IY = 0x5E,
+	FD_LD_H_idx_IY = 0x66,
+	FD_LD_idx_IY_B = 0x70,
+	FD_LD_idx_IY_C,
+	FD_LD_idx_IY_D,
+	FD_LD_idx_IY_E,
+	FD_LD_idx_IY_F,
+	FD_LD_idx_IY_L,
+	FD_LD_idx_IY_A = 0x77,
+	FD_LD_A_idx_IX = 0x7E,
+	FD_ADD_A_idx_IY = 0x86,
+	FD_ADC_A_idx_IY = 0x8E,
+	FD_SUB_A_idx_IY = 0x96,
+	FD_SBC_A_idx_IY = 0x9E,
+	FD_AND_A_idx_IY = 0xA6,
+	FD_XOR_A_idx_IY = 0xAE,
+	FD_OR_A_idx_IY = 0xB6,
+	FD_CP_idx_IY = 0xBE,
+	FD_JP_ind_IY = 0xE9
+};
+
+// Register pairs overlay a 16-bit word with its two 8-bit halves, in host
+// byte order, so pairs are read and written with a single access.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define REG_PAIR(pair, hi, lo) union { uint16_t pair; struct { uint8_t hi, lo; }; }
+#else
+#define REG_PAIR(pair, hi, lo) union { uint16_t pair; struct { uint8_t lo, hi; }; }
+#endif
+
+struct alignas(64) Registers {
+	REG_PAIR(af, a, f);
+	REG_PAIR(bc, b, c);
+	REG_PAIR(de, d, e);
+	REG_PAIR(hl, h, l);
+	REG_PAIR(af2, a2, f2);
+	REG_PAIR(bc2, b2, c2);
+	REG_PAIR(de2, d2, e2);
+	REG_PAIR(hl2, h2, l2);
+	uint16_t ix;
+	uint16_t iy;
+	uint16_t sp;
+	uint16_t pc;
+	uint8_t i;
+	uint8_t r;
+};
+
+#undef REG_PAIR
+
+// Host-side shadow of the guest call stack, updated on CALL and RET only.
+// Attributes cycles to subroutines and keeps a call tree for folded stack
+// output (as consumed by flamegraph.pl). Guest memory is never inspected;
+// frames abandoned by stack manipulation are closed on the next RET that
+// returns past them.
+class CallProfiler {
+public:
+	struct Stats {
+		uint64_t calls = 0;
+		uint64_t inclusive = 0;
+		uint64_t exclusive = 0;
+	};
+	
+	explicit CallProfiler(uint64_t now);
+	
+	void call(uint16_t target, uint16_t sp, uint64_t now);
+	void ret(uint16_t sp, uint64_t now);
+	
+	const Stats& stats(uint16_t addr) const { return stats_[addr]; }
+	size_t depth() const { return frames_.size() - 1; }
+	
+	// Copies the targets of up to max innermost open calls, outermost
+	// first, and returns how many.
+	size_t stack(uint16_t *addrs, size_t max) const;
+	
+	void write_report(std::ostream& out, uint64_t now) const;
+	void write_folded(std::ostream& out, uint64_t now) const;
+	
+private:
+	struct Node {
+		uint16_t addr;
+		uint32_t parent;
+		uint64_t self;
+	};
+	
+	struct Frame {
+		uint32_t node;
+		uint16_t addr;
+		uint16_t sp;
+		uint64_t entered;
+		uint64_t children;
+	};
+	
+	std::vector<Stats> stats_;
+	std::vector<uint32_t> active_;
+	std::vector<Node> nodes_;
+	std::unordered_map<uint64_t, uint32_t> edges_;
+	std::vector<Frame> frames_;
+	
+	void leave(uint64_t now);
+	std::string node_path(uint32_t node) const;
+};
+
+// Per-page counts of guest reads, writes and fetched instruction bytes,
+// with the cycle of the first and last access, for sizing caches and
+// pages. Alongside, the pages touched in each window of cycles give the
+// working set over time. Counting is plain increments into fixed arrays.
+// At most MAX_WINDOWS windows are kept; when they run out, neighbours are
+// merged and the window doubles, so long runs take no more memory.
+class AccessProfiler {
+public:
+	static const size_t MAX_WINDOWS = 4096;
+	
+	struct Page {
+		uint64_t reads;
+		uint64_t writes;
+		uint64_t fetches;
+		uint64_t first;     // ~0 if never touched
+		uint64_t last;
+	};
+	
+	AccessProfiler(uint64_t now, uint64_t window);
+	
+	void read(uint16_t addr, uint64_t now) { touch(reads_, addr, now); }
+	void write(uint16_t addr, uint64_t now) { touch(writes_, addr, now); }
+	void fetch(uint16_t addr, uint64_t now) { touch(fetches_, addr, now); }
+	
+	Page page(int page) const;
+	
+	// Number of pages touched in each window, from the cycle the profiler
+	// started at. A CPU rolled back to an earlier cycle count adds to the
+	// windows of that time again.
+	std::vector<int> working_set() const;
+	
+	uint64_t window() const { return window_; }
+	
+	// Adds the counts of a profiler with the same start. Whichever window
+	// is shorter is widened to the other.
+	void merge(const AccessProfiler& other);
+	
+	void write_csv(std::ostream& out) const;
+	void write_working_set_csv(std::ostream& out) const;
+	void write_json(std::ostream& out) const;
+	
+private:
+	typedef std::array<uint64_t, PAGE_COUNT> Counts;
+	
+	Counts reads_ {};
+	Counts writes_ {};
+	Counts fetches_ {};
+	Counts first_;
+	Counts last_ {};
+	
+	// pages touched per window, as bit masks; the current window's is
+	// kept in mask_ while it is in use
+	uint64_t start_;
+	uint64_t window_;
+	uint64_t window_start_;
+	size_t current_ = 0;
+	uint64_t mask_ = 0;
+	std::vector<uint64_t> windows_;
+	
+	void touch(Counts& counts, uint16_t addr, uint64_t now)
+	{
+		int page = addr >> PAGE_BITS;
+		counts[page]++;
+		first_[page] = now < first_[page] ? now : first_[page];
+		last_[page] = now;
+		if (now - window_start_ >= window_)
+			move_to(now);
+		mask_ |= 1ull << page;
+	}
+	
+	void move_to(uint64_t now);
+	void widen();
+};
+
+class Z80Base;
+
+// Statistical profile for runs where tracking every call is too heavy. A
+// SIGPROF timer sets a flag that the run loops check at block boundaries,
+// after any jump, call or return, so the cost between ticks is nil. The
+// block that was running is then recorded into a ring buffer: its first
+// address, the opcode page there (0 or the DD, ED or FD prefix) and, if
+// the CPU has a CallProfiler, the guest call stack. One profiler can run
+// per process at a time; CPUs on several threads may share it.
+class SampleProfiler {
+public:
+	static const int MAX_STACK = 8;
+	
+	struct Sample {
+		uint16_t pc;
+		uint8_t page;
+		uint8_t depth;
+		uint16_t stack[MAX_STACK];
+	};
+	
+	explicit SampleProfiler(size_t capacity = 1 << 16);
+	~SampleProfiler();
+	SampleProfiler(const SampleProfiler&) = delete;
+	SampleProfiler& operator=(const SampleProfiler&) = delete;
+	
+	// Samples hz times per second of process CPU time. Fails if another
+	// profiler is running or the timer can't be set.
+	bool start(unsigned hz = 1000);
+	void stop();
+	
+	// Set by the timer, claimed by the first CPU that sees it.
+	static std::atomic<bool> due;
+	
+	void record(uint16_t pc, uint8_t page, const CallProfiler *calls);
+	
+	// Samples taken, including any overwritten once the ring was full.
+	uint64_t samples() const { return next_; }
+	
+	// Hottest blocks with their share of samples and disassembly.
+	void write_report(std::ostream& out, Z80Base& cpu, size_t top = 20) const;
+	// Sample counts per call stack in flamegraph.pl's folded format.
+	void write_folded(std::ostream& out) const;
+	
+private:
+	std::vector<Sample> ring_;
+	std::atomic<uint64_t> next_;
+	
+	size_t size() const;
+};
+
+// A breakpoint or watchpoint condition, compiled from an expression such
+// as "a == 0x10 && [hl] != 0" to a small stack-machine bytecode so it can
+// be evaluated on every hit without parsing. Operands are numbers, the
+// registers a-l, af-hl, ix, iy, sp, pc, i and r, [addr] for a memory
+// byte and val for the byte a watchpoint sees. An empty condition is
+// always true.
+class Condition {
+public:
+	enum Code : uint8_t {
+		C_CONST,
+		C_REG,
+		C_VAL,
+		C_MEM,
+		C_NOT,
+		C_BNOT,
+		C_ADD,
+		C_SUB,
+		C_AND,
+		C_XOR,
+		C_OR,
+		C_EQ,
+		C_NE,
+		C_LT,
+		C_LE,
+		C_GT,
+		C_GE,
+		C_LAND,
+		C_LOR
+	};
+	
+	enum Reg : uint8_t {
+		R_A, R_F, R_B, R_C, R_D, R_E, R_H, R_L,
+		R_AF, R_BC, R_DE, R_HL, R_IX, R_IY, R_SP, R_PC, R_I, R_R,
+		R_COUNT
+	};
+	
+	static const int MAX_DEPTH = 16;
+	
+	static bool compile(const std::string& expr, Condition& cond, std::string* error = nullptr);
+	
+	bool empty() const { return code_.empty(); }
+	const std::vector<uint8_t>& code() const { return code_; }
+	
+private:
+	std::vector<uint8_t> code_;
+	
+	friend class ConditionParser;
+};
+
+enum Stop : uint8_t {
+	STOP_NONE,
+	STOP_NOP,
+	STOP_BREAKPOINT,
+	STOP_WATCH_READ,
+	STOP_WATCH_WRITE,
+	STOP_ILLEGAL,
+	STOP_LIMIT
+};
+
+// Layout of the trace written by run_to_nop().
+enum TraceFormat : uint8_t {
+	TRACE_DUMP,     // each instruction followed by all registers
+	TRACE_LINES     // a line per instruction with the registers before it
+};
+
+enum WatchKind : uint8_t {
+	WATCH_READ = 0x01,
+	WATCH_WRITE = 0x02
+};
+
+// Complete guest-visible machine state. Restoring one is a few copies,
+// far cheaper than constructing a new CPU.
+struct Snapshot {
+	Registers regs;
+	uint64_t cycles;
+	std::array<uint8_t, MEM_SIZE> ram;
+	std::array<uint8_t, 256> ports;
+};
+
+enum Feature : unsigned {
+	FEATURE_TRACE = 0x01,
+	FEATURE_PROFILE = 0x02,
+	FEATURE_WATCH = 0x04,
+	FEATURE_CYCLES = 0x08,
+	FEATURE_ALL = 0x0F,
+	
+	// Not a debugging feature but a memory layout: pages are mapped from
+	// a PageArena on first write instead of embedding 64 KiB per core.
+	FEATURE_COMPACT = 0x10
+};
+
+// Compile-time feature selection for Z80Core. Hooks for features a policy
+// leaves out are removed from the instantiated core rather than branched
+// over at run time. Profiling attributes cycles, so it implies counting
+// them.
+template <unsigned Bits>
+struct FeaturePolicy {
+	static const unsigned bits = Bits;
+	static const bool trace = (Bits & FEATURE_TRACE) != 0;
+	static const bool profile = (Bits & FEATURE_PROFILE) != 0;
+	static const bool watch = (Bits & FEATURE_WATCH) != 0;
+	static const bool cycles = (Bits & (FEATURE_CYCLES | FEATURE_PROFILE)) != 0;
+	static const bool compact = (Bits & FEATURE_COMPACT) != 0;
+};
+
+// Hands out 1 KiB pages to compact cores, carved from large chunks and
+// recycled through a free list. Chunks are only returned to the system
+// when the arena is destroyed. Thread-safe, though one arena per thread
+// avoids contention.
+class PageArena {
+public:
+	static const size_t CHUNK_PAGES = 256;
+	
+	PageArena() {}
+	PageArena(const PageArena&) = delete;
+	PageArena& operator=(const PageArena&) = delete;
+	
+	// Returns an uninitialised page.
+	uint8_t *alloc();
+	void free(uint8_t *page);
+	
+	size_t pages_used() const;
+	size_t bytes_reserved() const;
+	
+	// The arena of compact cores created without one.
+	static PageArena& shared();
+	
+	// A page of zeros mapped read-only by every compact core.
+	static uint8_t *zero_page();
+	
+private:
+	mutable std::mutex lock_;
+	std::vector<std::unique_ptr<uint8_t[]>> chunks_;
+	std::vector<uint8_t *> free_;
+	size_t next_ = CHUNK_PAGES;
+	size_t used_ = 0;
+};
+
+// A ROM image padded to whole pages, which any number of compact cores
+// can map without copying. Must outlive the cores mapping it.
+class RomImage {
+public:
+	RomImage(const uint8_t *data, size_t len);
+	
+	size_t pages() const { return data_.size() >> PAGE_BITS; }
+	size_t size() const { return data_.size(); }
+	uint8_t *page(size_t n) const { return const_cast<uint8_t *>(&data_[n << PAGE_BITS]); }
+	
+private:
+	std::vector<uint8_t> data_;
+};
+
+// Flat cores keep their memory inline; compact ones only a page table.
+template <bool Compact>
+struct RamStorage {
+	std::array<uint8_t, MEM_SIZE> ram;
+	
+	std::array<uint8_t, MEM_SIZE> *flat() { return &ram; }
+	uint8_t *data() { return ram.data(); }
+};
+
+template <>
+struct RamStorage<true> {
+	std::array<uint8_t, MEM_SIZE> *flat() { return nullptr; }
+	uint8_t *data() { return nullptr; }
+};
+
+// Called when the CPU stops on an error, such as an illegal opcode, with
+// the address of the offending instruction.
+typedef void (*ErrorHandler)(void *ctx, Stop reason, uint16_t addr);
+
+// CPU state and the parts of the emulator that are the same for every
+// feature set. Instructions are executed by Z80Core.
+class Z80Base {
+protected:
+	static const uint8_t FLAG_C = 0x01;
+	static const uint8_t FLAG_N = 0x02;
+	static const uint8_t FLAG_PV = 0x04;
+	static const uint8_t FLAG_H = 0x10;
+	static const uint8_t FLAG_Z = 0x40;
+	static const uint8_t FLAG_S = 0x80;
+	
+	// Per-page flags routing accesses to a slow path. The read/write fast
+	// path tests one byte; only pages with watchpoints pay for more.
+	static const uint8_t PAGE_BREAK = 0x01;
+	static const uint8_t PAGE_WATCH_READ = 0x02;
+	static const uint8_t PAGE_WATCH_WRITE = 0x04;
+	static const uint8_t PAGE_ROM = 0x08;        // guest writes are dropped
+	static const uint8_t PAGE_SHARED = 0x10;     // copied on first write
+	
+	struct Watchpoint {
+		uint16_t addr;
+		uint32_t len;
+		uint8_t kinds;
+		Condition cond;
+	};
+	
+	Registers r_ {};
+	uint64_t cycles_ = 0;
+	
+	// Every page is mapped, into the inline array of a flat core or to
+	// arena, ROM or zero pages for a compact one.
+	uint8_t *pages_[PAGE_COUNT];
+	std::array<uint8_t, MEM_SIZE> *flat_ = nullptr;
+	PageArena *arena_ = nullptr;
+	std::array<uint8_t, 256> ports_ = {};
+	
+	std::array<uint8_t, PAGE_COUNT> page_flags_ = {};
+	
+	bool fast_block_ = true;
+	std::unique_ptr<CallProfiler> profiler_;
+	std::unique_ptr<AccessProfiler> access_;
+	SampleProfiler *sampler_ = nullptr;
+	
+	// Idle loop state, see idle_skip(). Heads are 0x10000 when unset.
+	static const int IDLE_SPAN = 16;
+	static const int IDLE_TRIES = 3;
+	bool idle_skip_ = true;
+	uint64_t idle_cycles_ = 0;
+	uint32_t idle_head_ = 0x10000;
+	uint32_t idle_miss_ = 0x10000;
+	int idle_tries_ = 0;
+	uint64_t idle_mark_ = 0;
+	Registers idle_regs_ {};
+	
+	struct Checkpoint;
+	std::unique_ptr<Checkpoint> checkpoint_;
+	
+	// Trace text is formatted into trace_buf_ and written out in chunks.
+	static const int INSN_TEXT_MAX = 48;
+	static const int REGS_TEXT_MAX = 320;
+	static const size_t TRACE_BUF_SIZE = 1 << 16;
+	static const size_t TRACE_STEP_MAX = 512;
+	TraceFormat trace_format_ = TRACE_DUMP;
+	std::unique_ptr<char[]> trace_buf_;
+	char *trace_end_ = nullptr;
+	
+	std::unordered_map<uint16_t, Condition> breakpoints_;
+	std::vector<Watchpoint> watchpoints_;
+	Stop stop_ = STOP_NONE;
+	uint16_t stop_addr_ = 0;
+	
+	ErrorHandler error_fn_ = nullptr;
+	void *error_ctx_ = nullptr;
+	
+	bool fc() const { return (r_.f & FLAG_C) > 0; }
+	bool fn() const { return (r_.f & FLAG_N) > 0; }
+	bool fpv() const { return (r_.f & FLAG_PV) > 0; }
+	bool fh() const { return (r_.f & FLAG_H) > 0; }
+	bool fz() const { return (r_.f & FLAG_Z) > 0; }
+	bool fs() const { return (r_.f & FLAG_S) > 0; }
+
+	uint8_t w_calc_flags(uint8_t a, uint8_t b, uint8_t carry, bool is_sub);
+	uint8_t w_logic_flags(uint8_t result, bool half);
+	
+	uint8_t op_add(uint8_t a, uint8_t b) { return w_calc_flags(a, b, 0, false); }
+	uint8_t op_adc(uint8_t a, uint8_t b) { return w_calc_flags(a, b, r_.f & FLAG_C, false); }
+	uint8_t op_sub(uint8_t a, uint8_t b) { return w_calc_flags(a, b, 0, true); }
+	uint8_t op_sbc(uint8_t a, uint8_t b) { return w_calc_flags(a, b, r_.f & FLAG_C, true); }
+	uint8_t op_and(uint8_t a, uint8_t b) { return w_logic_flags(a & b, true); }
+	uint8_t op_xor(uint8_t a, uint8_t b) { return w_logic_flags(a ^ b, false); }
+	uint8_t op_or(uint8_t a, uint8_t b) { return w_logic_flags(a | b, false); }
+	void op_cp(uint8_t a) { w_calc_flags(r_.a, a, 0, true); }
+	uint8_t op_inc(uint8_t a) { return op_incdec(a, false); }
+	uint8_t op_dec(uint8_t a) { return op_incdec(a, true); }
+	uint8_t op_incdec(uint8_t a, bool is_sub);
+	void op_add16(uint16_t val);
+	
+	uint8_t next() { return peek(r_.pc++); }
+	uint16_t next16() { uint8_t lo = next(); return (uint16_t)next() << 8 | lo; }
+	uint16_t idx(uint16_t base) { return base + (int8_t)next(); }
+	
+	void init_memory(std::array<uint8_t, MEM_SIZE> *flat, PageArena *arena);
+	void unshare(int page);
+	void unmap(int page);
+	void drop_checkpoint();
+	
+	void idle_reset() { idle_head_ = idle_miss_ = 0x10000; }
+	uint64_t idle_skip(uint16_t branch, uint64_t now, uint64_t end, bool cycles, bool watch);
+	
+	void take_sample(uint16_t block);
+	
+	uint8_t read_watched(uint16_t addr);
+	void write_slow(uint16_t addr, uint8_t val, bool watch);
+	void check_watchpoints(uint16_t addr, uint8_t kind, uint8_t val);
+	bool check_breakpoint();
+	void update_page_flags();
+	
+	void illegal(uint16_t addr);
+	
+	uint16_t reg_value(uint8_t reg) const;
+	bool test(const Condition& cond, uint8_t val = 0) const;
+
+	std::string pc_str();
+	void dump_regs(std::ostream& out);
+	char *format_insn(char *out);
+	char *format_regs(char *out);
+	char *format_line(char *out);
+	
+	void trace_start();
+	void trace_insn(std::ostream& out);
+	void trace_regs();
+	void trace_stop(std::ostream& out);
+	
+public:
+	virtual ~Z80Base();
+	
+	// Keeps the register file cache-line aligned on the heap, which plain
+	// new does not guarantee before C++17.
+	static void *operator new(size_t size);
+	static void operator delete(void *ptr) { std::free(ptr); }
+	static void *operator new(size_t, void *where) { return where; }
+	static void operator delete(void *, void *) {}
+	
+	virtual void step() = 0;
+	// Runs until the next instruction is a NOOP. Stops early with
+	// STOP_LIMIT after at least limit T-states, or instructions on cores
+	// without FEATURE_CYCLES, at the first jump, call or return after.
+	virtual Stop run_to_nop(std::ostream *trace = nullptr, uint64_t limit = ~0ull) = 0;
+	
+	// Runs until at least the given number of T-states have elapsed or
+	// the CPU stops on a breakpoint, watchpoint or error. Cores without
+	// FEATURE_CYCLES don't count T-states and run that many instructions
+	// instead. ~0 runs until the CPU stops.
+	virtual Stop run_for(uint64_t cycles) = 0;
+	
+	// The FEATURE_* bits this core was compiled with. Tracing, profiling
+	// and break/watchpoints have no effect on cores built without them.
+	virtual unsigned features() const = 0;
+	
+	Registers& regs() { return r_; }
+	const Registers& regs() const { return r_; }
+	
+	// The memory of a flat core. Compact cores have none and must be
+	// accessed through peek(), poke() and the *_mem() functions.
+	std::array<uint8_t, MEM_SIZE>& ram() { return *flat_; }
+	const std::array<uint8_t, MEM_SIZE>& ram() const { return *flat_; }
+	bool compact() const { return !flat_; }
+	
+	uint8_t peek(uint16_t addr) const { return pages_[addr >> PAGE_BITS][addr & (PAGE_SIZE - 1)]; }
+	void poke(uint16_t addr, uint8_t val);
+	void read_mem(uint16_t addr, uint8_t *buf, size_t len) const;
+	void write_mem(uint16_t addr, const uint8_t *data, size_t len);
+	
+	// Maps a ROM image at a page-aligned address. Compact cores share its
+	// pages and drop guest writes to them; flat cores copy it into RAM,
+	// where it stays writable. Host writes through poke() or write_mem()
+	// give a compact core a private, still read-only, copy of the page.
+	bool map_rom(uint16_t addr, const RomImage& rom);
+	
+	// Pages a compact core has allocated from its arena.
+	size_t private_pages() const;
+	
+	std::array<uint8_t, 256>& ports() { return ports_; }
+	const std::array<uint8_t, 256>& ports() const { return ports_; }
+	
+	uint64_t cycles() const { return cycles_; }
+	
+	// Within run_for() and run_to_nop(), repeating block instructions
+	// execute all but their last iteration in one go when the range and
+	// the remaining budget allow it, with the same result as iterating.
+	// Disable to single-step them.
+	void set_fast_block(bool enable) { fast_block_ = enable; }
+	
+	// Short loops that only count down a register or poll unchanging
+	// memory are fast-forwarded, with the same result and cycle count as
+	// stepping through them. Disable to step every pass.
+	void set_idle_skip(bool enable) { idle_skip_ = enable; }
+	
+	// Cycles skipped that way since the last reset, or instructions on
+	// cores that don't count cycles.
+	uint64_t idle_cycles() const { return idle_cycles_; }
+	
+	// Starts tracking guest subroutines on CALL and RET. Returns the
+	// profiler for reporting; it stays owned by the CPU.
+	CallProfiler& enable_profiler();
+	CallProfiler* profiler() { return profiler_.get(); }
+	
+	// Starts counting guest memory accesses per page, with the working
+	// set taken over windows of the given number of cycles. Like the call
+	// profiler it needs FEATURE_PROFILE, and it turns off idle skipping
+	// and bulk block moves so that every access is seen.
+	AccessProfiler& enable_access_profiler(uint64_t window = 10000);
+	AccessProfiler* access_profiler() { return access_.get(); }
+	
+	// Records samples into sampler while it runs; null to stop.
+	void set_sampler(SampleProfiler *sampler) { sampler_ = sampler; }
+	
+	void set_trace_format(TraceFormat format) { trace_format_ = format; }
+	
+	// Breakpoints stop run_to_nop() before the instruction at addr runs,
+	// watchpoints after the instruction touching a watched byte. Resuming
+	// from a breakpoint does not hit it again.
+	void add_breakpoint(uint16_t addr, const Condition& cond = Condition());
+	void remove_breakpoint(uint16_t addr);
+	void add_watchpoint(uint16_t addr, uint32_t len, uint8_t kinds, const Condition& cond = Condition());
+	void remove_watchpoints(uint16_t addr, uint32_t len);
+	
+	std::string disassemble(uint16_t addr);
+	
+	// Zeroes registers, memory, ports and the cycle count. Compact cores
+	// return their pages to the arena and unmap ROM.
+	void reset();
+	void save(Snapshot& snap) const;
+	void restore(const Snapshot& snap);
+	
+	// Takes the current state as a baseline to return to with rollback().
+	// On compact cores the pages are kept, shared, so that rollback() only
+	// drops the pages written since, without copying. Flat cores copy all
+	// of memory both ways. Discarded by reset().
+	void checkpoint();
+	bool rollback();
+	
+	Stop stop_reason() const { return stop_; }
+	uint16_t stop_addr() const { return stop_addr_; }
+	
+	void set_error_handler(ErrorHandler fn, void *ctx) { error_fn_ = fn; error_ctx_ = ctx; }
+	
+	uint8_t reg_a() const { return r_.a; }
+	uint8_t reg_b() const { return r_.b; }
+	uint8_t reg_d() const { return r_.d; }
+	uint8_t reg_h() const { return r_.h; }
+	uint8_t reg_f() const { return r_.f; }
+	uint8_t reg_c() const { return r_.c; }
+	uint8_t reg_e() const { return r_.e; }
+	uint8_t reg_l() const { return r_.l; }
+	uint8_t reg_a2() const { return r_.a2; }
+	uint8_t reg_b2() const { return r_.b2; }
+	uint8_t reg_d2() const { return r_.d2; }
+	uint8_t reg_h2() const { return r_.h2; }
+	uint8_t reg_f2() const { return r_.f2; }
+	uint8_t reg_c2() const { return r_.c2; }
+	uint8_t reg_e2() const { return r_.e2; }
+	uint8_t reg_l2() const { return r_.l2; }
+	uint8_t reg_i() const { return r_.i; }
+	uint8_t reg_r() const { return r_.r; }
+	uint16_t reg_ix() const { return r_.ix; }
+	uint16_t reg_iy() const { return r_.iy; }
+	uint16_t reg_sp() const { return r_.sp; }
+	uint16_t reg_pc() const { return r_.pc; }
+	uint16_t reg_af() const { return r_.af; }
+	uint16_t reg_bc() const { return r_.bc; }
+	uint16_t reg_de() const { return r_.de; }
+	uint16_t reg_hl() const { return r_.hl; }
+};
+
+// An emulator core instantiated for one feature policy.
+template <class Policy>
+class Z80Core final : public Z80Base {
+	static const uint8_t PAGE_WRITE_SLOW = (Policy::watch ? PAGE_WATCH_WRITE : 0)
+		| (Policy::compact ? PAGE_ROM | PAGE_SHARED : 0);
+	
+	RamStorage<Policy::compact> storage_;
+	
+	void tick(uint64_t n) { if (Policy::cycles) cycles_ += n; }
+	
+	uint8_t& mem(uint16_t addr)
+	{
+		if (Policy::compact)
+			return pages_[addr >> PAGE_BITS][addr & (PAGE_SIZE - 1)];
+		return storage_.data()[addr];
+	}
+	
+	uint8_t next()
+	{
+		if (Policy::profile && access_)
+			access_->fetch(r_.pc, cycles_);
+		return mem(r_.pc++);
+	}
+	
+	uint16_t next16() { uint8_t lo = next(); return (uint16_t)next() << 8 | lo; }
+	uint16_t idx(uint16_t base) { return base + (int8_t)next(); }
+	
+	uint8_t read(uint16_t addr)
+	{
+		if (Policy::profile && access_)
+			access_->read(addr, cycles_);
+		if (Policy::watch && (page_flags_[addr >> PAGE_BITS] & PAGE_WATCH_READ))
+			return read_watched(addr);
+		return mem(addr);
+	}
+	
+	void write(uint16_t addr, uint8_t val)
+	{
+		if (Policy::profile && access_)
+			access_->write(addr, cycles_);
+		if (PAGE_WRITE_SLOW && (page_flags_[addr >> PAGE_BITS] & PAGE_WRITE_SLOW))
+			write_slow(addr, val, Policy::watch);
+		else
+			mem(addr) = val;
+	}
+	
+	void push(uint16_t val) { write(--r_.sp, val >> 8); write(--r_.sp, (uint8_t)val); }
+	uint16_t pop() { uint8_t lo = read(r_.sp++); return (uint16_t)read(r_.sp++) << 8 | lo; }
+	void op_call(uint16_t addr);
+	void op_ret();
+	
+	void op_ldi(int dir);
+	void op_cpi(int dir);
+	void op_ini();
+	void op_outi();
+	
+	bool can_bulk(uint16_t addr, uint32_t len, int dir, bool writes) const;
+	uint64_t bulk_repeat(uint16_t pc, uint64_t now, uint64_t end);
+	uint32_t bulk_ld(int dir, uint64_t room);
+	uint32_t bulk_cp(uint64_t room);
+	uint32_t bulk_in(uint64_t room);
+	uint32_t bulk_out(uint64_t room);
+	
+public:
+	// Compact cores take their pages from arena, or the shared arena.
+	explicit Z80Core(PageArena *arena = nullptr);
+	
+	void step() override;
+	Stop run_to_nop(std::ostream *trace = nullptr, uint64_t limit = ~0ull) override;
+	Stop run_for(uint64_t cycles) override;
+	unsigned features() const override { return Policy::bits; }
+};
+
+typedef FeaturePolicy<0> PlainPolicy;
+typedef FeaturePolicy<FEATURE_ALL> FullPolicy;
+
+// The fully instrumented core. Use make_z80() to pick a leaner one.
+typedef Z80Core<FullPolicy> Z80;
+
+extern template class Z80Core<PlainPolicy>;
+extern template class Z80Core<FullPolicy>;
+
+// Picks the core instantiation matching a set of FEATURE_* bits. Compact
+// cores allocate pages from arena, or PageArena::shared() if null.
+std::unique_ptr<Z80Base> make_z80(unsigned features, PageArena *arena = nullptr);
+
+#endif
@@ -0,0 +1,309 @@
+//
+//  z80_c.cpp
+//  z80
+//
+
+#include "z80_c.h"
+#include "z80.h"
+
+#include <new>
+
+using namespace std;
+
+struct z80 {
+	unique_ptr<Z80Base> core;
+	z80_error_fn error_fn = nullptr;
+	void *error_ctx = nullptr;
+};
+
+struct z80_rom {
+	RomImage image;
+};
+
+static int status_of(Stop stop)
+{
+	switch (stop) {
+		case STOP_BREAKPOINT: return Z80_BREAKPOINT;
+		case STOP_WATCH_READ: return Z80_WATCH_READ;
+		case STOP_WATCH_WRITE: return Z80_WATCH_WRITE;
+		case STOP_ILLEGAL: return Z80_ERR_ILLEGAL;
+		default: return Z80_OK;
+	}
+}
+
+static void forward_error(void *ctx, Stop reason, uint16_t addr)
+{
+	z80 *cpu = static_cast<z80 *>(ctx);
+	
+	if (cpu->error_fn)
+		cpu->error_fn(cpu->error_ctx, status_of(reason), addr);
+}
+
+static bool compile(const char *expr, Condition& cond)
+{
+	return !expr || !*expr || Condition::compile(expr, cond);
+}
+
+z80 *z80_create(unsigned features)
+{
+	try {
+		unique_ptr<z80> cpu(new z80());
+		cpu->core = make_z80((features & (FEATURE_WATCH | FEATURE_COMPACT)) | FEATURE_CYCLES);
+		cpu->core->reset();
+		cpu->core->set_error_handler(forward_error, cpu.get());
+		return cpu.release();
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+void z80_destroy(z80 *cpu)
+{
+	delete cpu;
+}
+
+int z80_load(z80 *cpu, uint16_t addr, const void *image, size_t len)
+{
+	if (!image && len)
+		return Z80_ERR_ARG;
+	if (addr + len > MEM_SIZE)
+		return Z80_ERR_RANGE;
+	
+	try {
+		cpu->core->reset();
+		cpu->core->write_mem(addr, static_cast<const uint8_t *>(image), len);
+		return Z80_OK;
+	} catch (const bad_alloc&) {
+		return Z80_ERR_NOMEM;
+	}
+}
+
+int z80_run(z80 *cpu, uint64_t cycles, uint64_t *elapsed)
+{
+	uint64_t start = cpu->core->cycles();
+	int status;
+	
+	try {
+		status = status_of(cpu->core->run_for(cycles));
+	} catch (const bad_alloc&) {
+		status = Z80_ERR_NOMEM;
+	}
+	
+	if (elapsed)
+		*elapsed = cpu->core->cycles() - start;
+	
+	return status;
+}
+
+uint64_t z80_cycles(const z80 *cpu)
+{
+	return cpu->core->cycles();
+}
+
+uint64_t z80_idle_cycles(const z80 *cpu)
+{
+	return cpu->core->idle_cycles();
+}
+
+void z80_set_idle_skip(z80 *cpu, int enable)
+{
+	cpu->core->set_idle_skip(enable != 0);
+}
+
+uint16_t z80_stop_addr(const z80 *cpu)
+{
+	return cpu->core->stop_addr();
+}
+
+uint16_t z80_get_reg(const z80 *cpu, int reg)
+{
+	const Registers& r = cpu->core->regs();
+	
+	switch (reg) {
+		case Z80_REG_AF: return r.af;
+		case Z80_REG_BC: return r.bc;
+		case Z80_REG_DE: return r.de;
+		case Z80_REG_HL: return r.hl;
+		case Z80_REG_AF2: return r.af2;
+		case Z80_REG_BC2: return r.bc2;
+		case Z80_REG_DE2: return r.de2;
+		case Z80_REG_HL2: return r.hl2;
+		case Z80_REG_IX: return r.ix;
+		case Z80_REG_IY: return r.iy;
+		case Z80_REG_SP: return r.sp;
+		case Z80_REG_PC: return r.pc;
+		case Z80_REG_I: return r.i;
+		case Z80_REG_R: return r.r;
+		default: return 0;
+	}
+}
+
+int z80_set_reg(z80 *cpu, int reg, uint16_t val)
+{
+	Registers& r = cpu->core->regs();
+	
+	switch (reg) {
+		case Z80_REG_AF: r.af = val; break;
+		case Z80_REG_BC: r.bc = val; break;
+		case Z80_REG_DE: r.de = val; break;
+		case Z80_REG_HL: r.hl = val; break;
+		case Z80_REG_AF2: r.af2 = val; break;
+		case Z80_REG_BC2: r.bc2 = val; break;
+		case Z80_REG_DE2: r.de2 = val; break;
+		case Z80_REG_HL2: r.hl2 = val; break;
+		case Z80_REG_IX: r.ix = val; break;
+		case Z80_REG_IY: r.iy = val; break;
+		case Z80_REG_SP: r.sp = val; break;
+		case Z80_REG_PC: r.pc = val; break;
+		case Z80_REG_I: r.i = (uint8_t)val; break;
+		case Z80_REG_R: r.r = (uint8_t)val; break;
+		default: return Z80_ERR_ARG;
+	}
+	
+	return Z80_OK;
+}
+
+int z80_read(const z80 *cpu, uint16_t addr, void *buf, size_t len)
+{
+	if (!buf && len)
+		return Z80_ERR_ARG;
+	if (addr + len > MEM_SIZE)
+		return Z80_ERR_RANGE;
+	
+	cpu->core->read_mem(addr, static_cast<uint8_t *>(buf), len);
+	return Z80_OK;
+}
+
+int z80_write(z80 *cpu, uint16_t addr, const void *data, size_t len)
+{
+	if (!data && len)
+		return Z80_ERR_ARG;
+	if (addr + len > MEM_SIZE)
+		return Z80_ERR_RANGE;
+	
+	try {
+		cpu->core->write_mem(addr, static_cast<const uint8_t *>(data), len);
+		return Z80_OK;
+	} catch (const bad_alloc&) {
+		return Z80_ERR_NOMEM;
+	}
+}
+
+uint8_t z80_peek(const z80 *cpu, uint16_t addr)
+{
+	return cpu->core->peek(addr);
+}
+
+int z80_poke(z80 *cpu, uint16_t addr, uint8_t val)
+{
+	try {
+		cpu->core->poke(addr, val);
+		return Z80_OK;
+	} catch (const bad_alloc&) {
+		return Z80_ERR_NOMEM;
+	}
+}
+
+z80_rom *z80_rom_create(const void *image, size_t len)
+{
+	if ((!image && len) || len > MEM_SIZE)
+		return nullptr;
+	
+	try {
+		return new z80_rom { RomImage(static_cast<const uint8_t *>(image), len) };
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+void z80_rom_destroy(z80_rom *rom)
+{
+	delete rom;
+}
+
+int z80_map_rom(z80 *cpu, uint16_t addr, const z80_rom *rom)
+{
+	if (!rom || addr & (PAGE_SIZE - 1))
+		return Z80_ERR_ARG;
+	if (addr + rom->image.size() > MEM_SIZE)
+		return Z80_ERR_RANGE;
+	
+	try {
+		cpu->core->map_rom(addr, rom->image);
+		return Z80_OK;
+	} catch (const bad_alloc&) {
+		return Z80_ERR_NOMEM;
+	}
+}
+
+uint8_t z80_get_port(const z80 *cpu, uint8_t port)
+{
+	return cpu->core->ports()[port];
+}
+
+void z80_set_port(z80 *cpu, uint8_t port, uint8_t val)
+{
+	cpu->core->ports()[port] = val;
+}
+
+int z80_add_breakpoint(z80 *cpu, uint16_t addr, const char *cond)
+{
+	try {
+		Condition compiled;
+		if (!compile(cond, compiled))
+			return Z80_ERR_ARG;
+		cpu->core->add_breakpoint(addr, compiled);
+		return Z80_OK;
+	} catch (const bad_alloc&) {
+		return Z80_ERR_NOMEM;
+	}
+}
+
+void z80_remove_breakpoint(z80 *cpu, uint16_t addr)
+{
+	cpu->core->remove_breakpoint(addr);
+}
+
+int z80_add_watchpoint(z80 *cpu, uint16_t addr, uint32_t len, unsigned kinds, const char *cond)
+{
+	if (!len || !(kinds & (WATCH_READ | WATCH_WRITE)))
+		return Z80_ERR_ARG;
+	if (addr + len > MEM_SIZE)
+		return Z80_ERR_RANGE;
+	
+	try {
+		Condition compiled;
+		if (!compile(cond, compiled))
+			return Z80_ERR_ARG;
+		cpu->core->add_watchpoint(addr, len, (uint8_t)kinds, compiled);
+		return Z80_OK;
+	} catch (const bad_alloc&) {
+		return Z80_ERR_NOMEM;
+	}
+}
+
+void z80_remove_watchpoints(z80 *cpu, uint16_t addr, uint32_t len)
+{
+	cpu->core->remove_watchpoints(addr, len);
+}
+
+void z80_set_error_handler(z80 *cpu, z80_error_fn fn, void *ctx)
+{
+	cpu->error_fn = fn;
+	cpu->error_ctx = ctx;
+}
+
+const char *z80_strerror(int status)
+{
+	switch (status) {
+		case Z80_OK: return "ok";
+		case Z80_BREAKPOINT: return "breakpoint";
+		case Z80_WATCH_READ: return "watchpoint read";
+		case Z80_WATCH_WRITE: return "watchpoint write";
+		case Z80_ERR_ILLEGAL: return "illegal opcode";
+		case Z80_ERR_ARG: return "invalid argument";
+		case Z80_ERR_RANGE: return "out of range";
+		case Z80_ERR_NOMEM: return "out of memory";
+		default: return "unknown error";
+	}
+}
@@ -0,0 +1,125 @@
+//
+//  z80_c.h
+//  z80
+//
+//  C interface to the emulator core, for embedding from C or through an
+//  FFI. Functions never throw or write to stdio; errors are reported as
+//  Z80_* status codes and, for CPU errors, through an optional callback.
+//
+
+#ifndef Z80_C_H
+#define Z80_C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define Z80_API
+#else
+#define Z80_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct z80 z80;
+typedef struct z80_rom z80_rom;
+
+enum z80_status {
+	Z80_OK = 0,
+	Z80_BREAKPOINT = 1,     // stopped before a breakpoint
+	Z80_WATCH_READ = 2,     // stopped after a watched read
+	Z80_WATCH_WRITE = 3,    // stopped after a watched write
+	Z80_ERR_ILLEGAL = -1,   // stopped after an illegal opcode
+	Z80_ERR_ARG = -2,       // invalid argument
+	Z80_ERR_RANGE = -3,     // access past the end of memory or ports
+	Z80_ERR_NOMEM = -4
+};
+
+enum z80_feature {
+	Z80_FEATURE_WATCH = 0x04,    // breakpoints and watchpoints
+	Z80_FEATURE_COMPACT = 0x10   // allocate memory per page on first write
+};
+
+enum z80_watch {
+	Z80_WATCH_READ_ACCESS = 0x01,
+	Z80_WATCH_WRITE_ACCESS = 0x02
+};
+
+enum z80_reg {
+	Z80_REG_AF, Z80_REG_BC, Z80_REG_DE, Z80_REG_HL,
+	Z80_REG_AF2, Z80_REG_BC2, Z80_REG_DE2, Z80_REG_HL2,
+	Z80_REG_IX, Z80_REG_IY, Z80_REG_SP, Z80_REG_PC,
+	Z80_REG_I, Z80_REG_R
+};
+
+// Called with the status and the address of the offending instruction
+// when the CPU stops on an error.
+typedef void (*z80_error_fn)(void *ctx, int status, uint16_t addr);
+
+// Creates a CPU with zeroed registers, memory and ports. Cycles are always
+// counted; Z80_FEATURE_WATCH adds breakpoint and watchpoint checks, which
+// are accepted but never hit without it. Z80_FEATURE_COMPACT trades some
+// speed for a footprint of about 1 KiB plus the pages written to, for
+// running very many CPUs at once. Returns NULL if out of memory.
+Z80_API z80 *z80_create(unsigned features);
+Z80_API void z80_destroy(z80 *cpu);
+
+// Resets registers, memory, ports and the cycle count to zero, unmaps any
+// ROM and copies len bytes of image to addr.
+Z80_API int z80_load(z80 *cpu, uint16_t addr, const void *image, size_t len);
+
+// Runs for at least the given number of T-states. Returns Z80_OK when the
+// budget is used up, otherwise the reason for stopping early, which for
+// compact CPUs includes Z80_ERR_NOMEM. UINT64_MAX runs until the CPU
+// stops. The number of T-states actually run is stored in *elapsed if not
+// NULL.
+Z80_API int z80_run(z80 *cpu, uint64_t cycles, uint64_t *elapsed);
+
+Z80_API uint64_t z80_cycles(const z80 *cpu);
+
+// Countdown and polling loops are fast-forwarded with the same outcome
+// and cycle count as running them; this reports how many cycles were
+// skipped since the last z80_load(). Disabled with enable = 0.
+Z80_API uint64_t z80_idle_cycles(const z80 *cpu);
+Z80_API void z80_set_idle_skip(z80 *cpu, int enable);
+Z80_API uint16_t z80_stop_addr(const z80 *cpu);
+
+// 8-bit registers read and write the low byte.
+Z80_API uint16_t z80_get_reg(const z80 *cpu, int reg);
+Z80_API int z80_set_reg(z80 *cpu, int reg, uint16_t val);
+
+Z80_API int z80_read(const z80 *cpu, uint16_t addr, void *buf, size_t len);
+Z80_API int z80_write(z80 *cpu, uint16_t addr, const void *data, size_t len);
+Z80_API uint8_t z80_peek(const z80 *cpu, uint16_t addr);
+Z80_API int z80_poke(z80 *cpu, uint16_t addr, uint8_t val);
+
+// A ROM image that any number of compact CPUs can map without copying it.
+// It must outlive every CPU it is mapped into. Non-compact CPUs get a
+// writable copy. addr must be a multiple of 1024; writes by the CPU are
+// ignored.
+Z80_API z80_rom *z80_rom_create(const void *image, size_t len);
+Z80_API void z80_rom_destroy(z80_rom *rom);
+Z80_API int z80_map_rom(z80 *cpu, uint16_t addr, const z80_rom *rom);
+
+Z80_API uint8_t z80_get_port(const z80 *cpu, uint8_t port);
+Z80_API void z80_set_port(z80 *cpu, uint8_t port, uint8_t val);
+
+// Conditions use the expression syntax of the C++ Condition class, for
+// example "a == 0x10 && [hl] != 0"; NULL or "" always stops. Returns
+// Z80_ERR_ARG if the condition doesn't compile.
+Z80_API int z80_add_breakpoint(z80 *cpu, uint16_t addr, const char *cond);
+Z80_API void z80_remove_breakpoint(z80 *cpu, uint16_t addr);
+Z80_API int z80_add_watchpoint(z80 *cpu, uint16_t addr, uint32_t len, unsigned kinds,
+	const char *cond);
+Z80_API void z80_remove_watchpoints(z80 *cpu, uint16_t addr, uint32_t len);
+
+Z80_API void z80_set_error_handler(z80 *cpu, z80_error_fn fn, void *ctx);
+Z80_API const char *z80_strerror(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif